@@ -4,16 +4,144 @@
 // 全局变量
 TCPClient *client = nullptr;
 std::thread receiver_thread;
-bool receiving = false;
+std::atomic<bool> receiving(false); // 接收线程与输入线程共用
+std::map<std::string, std::string> pending_shares; // 等待服务器答复的分享：哈希到本地路径
+std::mutex shares_mutex;
+std::string my_nickname;   // 当前昵称（重连失败时重新登录）
+std::string session_token; // 服务器签发的会话令牌，断线重连时凭它恢复会话
+uint64_t last_seq = 0;     // 已收到的最大广播消息序号，重连时只补发之后的消息
+
+// 处理服务器对分享的答复，返回true表示该消息已处理
+bool handleShareReply(const std::string &msg)
+{
+    // 服务器没有这份内容，上传一次（以哈希作为文件名）
+    if (msg.compare(0, 13, "SHARE_UPLOAD ") == 0)
+    {
+        std::string hash = msg.substr(13);
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(shares_mutex);
+            auto it = pending_shares.find(hash);
+            if (it == pending_shares.end())
+                return true;
+            path = it->second;
+        }
+        client->send_file(path, STREAM_DEFAULT_PRIORITY, hash);
+        return true;
+    }
+
+    // 已在聊天室发布
+    if (msg.compare(0, 9, "SHARE_OK ") == 0)
+    {
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(shares_mutex);
+            auto it = pending_shares.find(msg.substr(9));
+            if (it != pending_shares.end())
+            {
+                path = it->second;
+                pending_shares.erase(it);
+            }
+        }
+        client->log_info("文件已分享: " + path);
+        return true;
+    }
+
+    // 分享失败（上传的内容与哈希不符，或服务器重启），原因见服务器另发的系统消息
+    if (msg.compare(0, 13, "SHARE_FAILED ") == 0)
+    {
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(shares_mutex);
+            auto it = pending_shares.find(msg.substr(13));
+            if (it != pending_shares.end())
+            {
+                path = it->second;
+                pending_shares.erase(it);
+            }
+        }
+        client->log_error("文件分享失败: " + path);
+        return true;
+    }
+    return false;
+}
+
+// 处理会话相关的消息，返回true表示该消息已处理；广播消息去掉序号后留给调用者显示
+bool handleSessionMessage(std::string &msg)
+{
+    if (msg.compare(0, 8, "SESSION ") == 0)
+    {
+        session_token = msg.substr(8);
+        return true;
+    }
+    if (msg.compare(0, 8, "RESUMED ") == 0)
+    {
+        client->log_info("已恢复会话，正在补发断线期间的消息");
+        return true;
+    }
+    // 会话已失效（如服务器重启前未交接），重新登录
+    if (msg == "RESUME_FAILED")
+    {
+        session_token.clear();
+        client->log_info("会话已失效，重新加入聊天");
+        client->send_data("NICKNAME " + my_nickname);
+        return true;
+    }
+
+    // MSG 序号 消息：记录序号，跳过重复补发的消息
+    if (msg.compare(0, 4, "MSG ") == 0)
+    {
+        size_t space = msg.find(' ', 4);
+        if (space == std::string::npos)
+            return false;
+        uint64_t seq = std::strtoull(msg.c_str() + 4, nullptr, 10);
+        if (seq != 0 && seq <= last_seq)
+            return true;
+        last_seq = std::max(last_seq, seq);
+        msg.erase(0, space + 1);
+    }
+    return false;
+}
+
+// 断线后重连，并凭会话令牌恢复会话（没有令牌则重新登录）
+bool resumeSession()
+{
+    client->log_info("与服务器的连接已断开，正在重连...");
+    if (!client->reconnect())
+        return false;
+
+    // 服务器随旧连接丢弃了等待中的分享
+    {
+        std::lock_guard<std::mutex> lock(shares_mutex);
+        if (!pending_shares.empty())
+            client->log_info("断线前未完成的 " + std::to_string(pending_shares.size()) + " 个分享已取消，请重新分享");
+        pending_shares.clear();
+    }
+
+    if (session_token.empty())
+        return client->send_data("NICKNAME " + my_nickname);
+    return client->send_data("RESUME " + session_token + " " + std::to_string(last_seq));
+}
 
 // 接收消息线程函数
 void receiveMessages()
 {
     std::string msg;
-    while (receiving && client->isConnected())
+    while (receiving)
     {
         if (client->receive_data(msg))
         {
+            // 服务器连接数已满，等待服务器关闭连接
+            if (msg.compare(0, 12, "SERVER_BUSY ") == 0)
+            {
+                client->log_info(msg.substr(12));
+                continue;
+            }
+            if (handleShareReply(msg) || handleSessionMessage(msg))
+            {
+                continue;
+            }
+
             ConsoleColor::set(ConsoleColor::YELLOW);
             std::cout << "\n"
                       << msg << std::endl;
@@ -21,11 +149,12 @@ void receiveMessages()
             std::cout << "请输入消息 (输入exit退出): ";
             std::cout.flush();
         }
-        else
+        else if (!receiving || !resumeSession())
         {
             break;
         }
     }
+    receiving = false;
 }
 
 // 启动接收消息
@@ -48,10 +177,39 @@ void stopReceiving()
     }
 }
 
+// 上传文件、分享文件、下载共享文件的命令前缀
+const std::string FILE_COMMAND = "/file ";
+const std::string SHARE_COMMAND = "/share ";
+const std::string GET_COMMAND = "/get ";
+const std::string SEARCH_COMMAND = "/search "; // 搜索聊天记录
+
+// 分享文件：先发送内容哈希，服务器已有相同内容时无需上传
+bool shareFile(const std::string &path)
+{
+    std::string hash;
+    long long size = 0;
+    if (!sha256_file(path, hash, size))
+    {
+        client->log_error("无法打开文件: " + path);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(shares_mutex);
+        pending_shares[hash] = path;
+    }
+    return client->send_data("SHARE " + hash + " " + std::to_string(size) + " " + file_basename(path));
+}
+
+// 本机套接字地址前缀（如 local:chat_server.sock）
+const std::string LOCAL_PREFIX = "local:";
+std::string local_path; // 非空时通过本机套接字连接
+
 // 连接到服务器并设置昵称
 bool connectWithNickname(const std::string &nickname)
 {
-    if (!client->connect())
+    bool connected = local_path.empty() ? client->connect() : client->connect_local(local_path);
+    if (!connected)
     {
         client->log_error("连接服务器失败");
         return false;
@@ -86,14 +244,21 @@ int main()
     ConsoleColor::set(ConsoleColor::WHITE);
 
     std::string server_ip;
-    int port;
-    std::string nickname;
+    int port = 0;
+    std::string &nickname = my_nickname;
 
-    // 获取用户输入
+    // 获取用户输入（同机服务器可输入 local:套接字路径）
     std::cout << "请输入服务器IP: ";
     std::cin >> server_ip;
-    std::cout << "请输入端口号: ";
-    std::cin >> port;
+    if (server_ip.compare(0, LOCAL_PREFIX.size(), LOCAL_PREFIX) == 0)
+    {
+        local_path = server_ip.substr(LOCAL_PREFIX.size());
+    }
+    else
+    {
+        std::cout << "请输入端口号: ";
+        std::cin >> port;
+    }
     std::cin.ignore(); // 忽略换行符
     std::cout << "请输入你的昵称: ";
     std::getline(std::cin, nickname);
@@ -116,24 +281,56 @@ int main()
     // 主线程处理输入
     std::string input;
     std::cout << "连接成功！";
-    while (client->isConnected())
+    while (receiving && std::getline(std::cin, input) && input != "exit")
     {
-        std::getline(std::cin, input);
+        // 接收线程已放弃重连
+        if (!receiving)
+        {
+            break;
+        }
 
-        if (sendMessage(input))
+        // /file 路径：在后台上传文件，上传期间仍可继续聊天
+        if (input.compare(0, FILE_COMMAND.size(), FILE_COMMAND) == 0)
         {
-            if (input == "exit")
-            {
-                break;
-            }
+            client->send_file(input.substr(FILE_COMMAND.size()));
             std::cout << "请输入消息 (输入exit退出): ";
+            continue;
         }
-        else
+
+        // /share 路径：分享给聊天室所有人；/get 哈希：下载别人分享的文件
+        if (input.compare(0, SHARE_COMMAND.size(), SHARE_COMMAND) == 0)
         {
-            break;
+            shareFile(input.substr(SHARE_COMMAND.size()));
+            std::cout << "请输入消息 (输入exit退出): ";
+            continue;
+        }
+        if (input.compare(0, GET_COMMAND.size(), GET_COMMAND) == 0)
+        {
+            sendMessage("GET " + input.substr(GET_COMMAND.size()));
+            std::cout << "请输入消息 (输入exit退出): ";
+            continue;
+        }
+
+        // /search 关键词 [from:昵称] [since:YYYY-MM-DD] [until:YYYY-MM-DD]
+        if (input.compare(0, SEARCH_COMMAND.size(), SEARCH_COMMAND) == 0)
+        {
+            sendMessage("SEARCH " + input.substr(SEARCH_COMMAND.size()));
+            std::cout << "请输入消息 (输入exit退出): ";
+            continue;
         }
+
+        // 断线重连期间发送失败，消息不会补发
+        sendMessage(input);
+        std::cout << "请输入消息 (输入exit退出): ";
     }
 
+    // 先停止重连再通知服务器退出，服务器关闭连接后接收线程随之退出
+    client->cancel_reconnect();
+    receiving = false;
+    if (client->isConnected())
+    {
+        sendMessage("exit");
+    }
     stopReceiving();
     client->disconnect();
     client->log_info("已断开与服务器的连接");
@@ -17,57 +17,1809 @@ std::map<SOCKET, std::string> client_nicknames; // 套接字到昵称的映射
 std::map<SOCKET, ClientState> client_states;    // 套接字到状态的映射
 std::mutex clients_mutex;                       // 保护客户端集合的互斥锁
 
-// 工具函数
+// 工具函数：去掉首尾的ASCII空白（UTF-8多字节字符不受影响）
 std::string trim(const std::string &s)
 {
-    auto start = s.begin();
-    while (start != s.end() && std::isspace(*start))
+    size_t begin, end;
+    trim_span(s.data(), s.size(), begin, end);
+    return s.substr(begin, end - begin);
+}
+
+// 工具函数：昵称不能为空，也不能含控制字符（换行会被当作对等链路上的命令分隔符）
+bool isValidNickname(const std::string &nickname)
+{
+    if (nickname.empty())
+        return false;
+    for (unsigned char c : nickname)
+    {
+        if (c < 0x20 || c == 0x7f)
+            return false;
+    }
+    return true;
+}
+
+// 广播消息给所有客户端（除了发送者）
+void broadcast(SOCKET sender, const std::string &msg)
+{
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    for (SOCKET client : clients)
+    {
+        if (client != sender)
+        {
+            // 直接发送数据，不通过服务器实例
+            // 这里需要访问服务器实例来发送数据
+        }
+    }
+}
+
+// 获取客户端昵称
+std::string getNickname(SOCKET client_sock, const std::string &client_ip)
+{
+    std::lock_guard<std::mutex> lock(clients_mutex);
+    auto it = client_nicknames.find(client_sock);
+    if (it != client_nicknames.end())
+    {
+        return it->second;
+    }
+    return client_ip;
+}
+
+// 对等服务器重连间隔（毫秒）
+const int PEER_RETRY_MIN_MS = 1000;
+const int PEER_RETRY_MAX_MS = 30000;
+
+// 对等服务器链路（服务器之间转发消息、同步在线用户）
+struct PeerLink
+{
+    std::string id;                  // 对端服务器标识
+    std::string addr;                // 主动连出的对端地址（对端主动连入时为空）
+    std::string pending;             // 尚未凑成整行的数据
+    std::set<std::string> nicknames; // 对端服务器上的在线用户
+    bool verified = false;           // 对端已出示正确的共享密钥
+};
+
+// 比较对等链路密钥（耗时与内容无关；未配置密钥时一律拒绝）
+bool peerSecretMatches(const std::string &given, const std::string &expected)
+{
+    if (expected.empty() || given.size() != expected.size())
+    {
+        return false;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < given.size(); ++i)
+    {
+        diff |= (unsigned char)(given[i] ^ expected[i]);
+    }
+    return diff == 0;
+}
+
+// 共享文件库目录
+const char BLOB_DIR[] = "blobs";
+
+// 数据目录按端口区分（如 blobs-8888），同一目录下启动的多个服务器互不干扰，热重启的新进程沿用同一端口的数据
+std::string dataDir(const std::string &base, int port)
+{
+    return base + "-" + std::to_string(port);
+}
+
+// 按内容哈希存放的共享文件库：同样的内容只上传、只存一份，同时进行的下载共用一份内存映射
+class BlobStore
+{
+private:
+    std::string dir;
+    std::mutex mutex;
+    std::map<std::string, std::weak_ptr<const MappedFile>> mapped; // 正在被下载的文件
+
+public:
+    explicit BlobStore(const std::string &dir) : dir(dir) {}
+
+    void init()
+    {
+        CreateDirectoryA(dir.c_str(), NULL);
+    }
+
+    std::string path_of(const std::string &hash) const
+    {
+        return dir + "\\" + hash;
+    }
+
+    // 库中是否已有该内容，有则给出实际大小
+    bool contains(const std::string &hash, long long &size) const
+    {
+        std::ifstream file(path_of(hash), std::ios::binary | std::ios::ate);
+        if (!file.is_open())
+            return false;
+        size = (long long)file.tellg();
+        return true;
+    }
+
+    // 把上传完成的文件按哈希收入库中；内容与哈希不符时删除并返回false
+    bool add(const std::string &file_path, const std::string &hash)
+    {
+        std::string digest;
+        long long size = 0;
+        if (!sha256_file(file_path, digest, size) || digest != hash)
+        {
+            std::remove(file_path.c_str());
+            return false;
+        }
+        long long stored_size = 0;
+        if (contains(hash, stored_size))
+        {
+            std::remove(file_path.c_str());
+            return true;
+        }
+        return MoveFileExA(file_path.c_str(), path_of(hash).c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+    }
+
+    // 打开共享文件；已有下载在进行时复用同一份映射
+    std::shared_ptr<const MappedFile> open(const std::string &hash)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = mapped.find(hash);
+        if (it != mapped.end())
+        {
+            if (std::shared_ptr<const MappedFile> existing = it->second.lock())
+            {
+                return existing;
+            }
+        }
+
+        // 顺便清理已无人使用的映射记录
+        for (auto expired = mapped.begin(); expired != mapped.end();)
+        {
+            if (expired->second.expired())
+                expired = mapped.erase(expired);
+            else
+                ++expired;
+        }
+
+        std::shared_ptr<const MappedFile> blob = MappedFile::open(path_of(hash));
+        if (blob)
+        {
+            mapped[hash] = blob;
+        }
+        return blob;
+    }
+};
+
+// 离线消息参数
+const char OFFLINE_DIR[] = "offline";
+const long long OFFLINE_SEGMENT_SIZE = 16 * 1024 * 1024; // 共享消息日志的分段大小，所有离线用户都已越过的段被删除
+const long long OFFLINE_REPLAY_LIMIT = 4 * 1024 * 1024;  // 单个用户上线时最多补发的字节数，超出时丢弃最早的消息
+const long long OFFLINE_EXPIRE_SECONDS = 7 * 24 * 3600;  // 离线超过此时间仍未上线的用户不再为其保存消息
+
+// 离线消息日志：所有离线用户共用一份按顺序追加的日志，每条消息只写一次；
+// 每个离线用户只记录离线时的日志位置，上线时从该位置读到末尾
+// 日志按 OFFLINE_SEGMENT_SIZE 分段存放（文件名为段起始位置），记录格式：长度(4字节) + 内容
+class OfflineStore
+{
+private:
+    struct User
+    {
+        long long start; // 离线时的日志位置
+        long long since; // 离线时刻
+    };
+
+    std::string dir;
+    std::map<std::string, User> users; // 离线用户昵称
+    std::vector<long long> segments;   // 各段的起始位置（升序），最后一段为当前写入段
+    long long end;                     // 日志末尾位置
+    std::ofstream out;                 // 当前写入段
+    long long last_expire;             // 上次清理过期用户的时刻
+    bool closed;                       // 已交接给新进程，不再写入
+    std::mutex mutex;
+
+    // 昵称转为十六进制写入索引，避免空格和换行
+    static std::string hex_encode(const std::string &str)
+    {
+        static const char hex[] = "0123456789abcdef";
+        std::string out;
+        for (unsigned char c : str)
+        {
+            out += hex[c >> 4];
+            out += hex[c & 0xf];
+        }
+        return out;
+    }
+
+    static std::string hex_decode(const std::string &str)
+    {
+        std::string out;
+        for (size_t i = 0; i + 1 < str.size(); i += 2)
+        {
+            out += (char)std::stoi(str.substr(i, 2), nullptr, 16);
+        }
+        return out;
+    }
+
+    std::string segment_path(long long start) const
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.log", (unsigned long long)start);
+        return dir + "\\" + name;
+    }
+
+    std::string index_path() const
+    {
+        return dir + "\\users.idx";
+    }
+
+    static long long now()
+    {
+        return (long long)std::time(nullptr);
+    }
+
+    // 删除所有离线用户都已越过的段；没有离线用户时删除全部
+    void collect()
+    {
+        long long min_start = end;
+        for (auto &entry : users)
+        {
+            min_start = std::min(min_start, entry.second.start);
+        }
+        size_t keep = 0;
+        while (keep < segments.size() && (users.empty() || (keep + 1 < segments.size() && segments[keep + 1] <= min_start)))
+        {
+            ++keep;
+        }
+        if (keep == 0)
+        {
+            return;
+        }
+        if (keep == segments.size())
+        {
+            out.close();
+        }
+        for (size_t i = 0; i < keep; ++i)
+        {
+            std::remove(segment_path(segments[i]).c_str());
+        }
+        segments.erase(segments.begin(), segments.begin() + keep);
+    }
+
+    // 移除离线太久的用户
+    void expire()
+    {
+        long long current = now();
+        if (current - last_expire < 60)
+        {
+            return;
+        }
+        last_expire = current;
+        for (auto it = users.begin(); it != users.end();)
+        {
+            if (current - it->second.since > OFFLINE_EXPIRE_SECONDS)
+                it = users.erase(it);
+            else
+                ++it;
+        }
+        collect();
+    }
+
+public:
+    explicit OfflineStore(const std::string &dir) : dir(dir), end(0), last_expire(0), closed(false) {}
+
+    // 删除目录中的全部日志分段（上次运行没有交接就退出时遗留，已无人引用）
+    void remove_stale_segments()
+    {
+        WIN32_FIND_DATAA found;
+        HANDLE find = FindFirstFileA((dir + "\\*.log").c_str(), &found);
+        if (find == INVALID_HANDLE_VALUE)
+            return;
+        do
+        {
+            std::remove((dir + "\\" + found.cFileName).c_str());
+        } while (FindNextFileA(find, &found));
+        FindClose(find);
+    }
+
+    // 创建目录并载入上次交接时记录的离线用户和日志分段；没有索引（正常退出或崩溃）时清掉遗留的分段
+    void init()
+    {
+        CreateDirectoryA(dir.c_str(), NULL);
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ifstream index(index_path());
+        if (!index.is_open())
+        {
+            remove_stale_segments();
+            return;
+        }
+        std::string kind;
+        while (index >> kind)
+        {
+            if (kind == "SEG")
+            {
+                long long start;
+                index >> start;
+                segments.push_back(start);
+            }
+            else if (kind == "USER")
+            {
+                std::string hex;
+                User user;
+                index >> hex >> user.start >> user.since;
+                users[hex_decode(hex)] = user;
+            }
+        }
+        index.close();
+        // 索引只代表交接那一刻，读完即删，避免异常退出后重复补发
+        std::remove(index_path().c_str());
+
+        if (!segments.empty())
+        {
+            std::ifstream last(segment_path(segments.back()), std::ios::binary | std::ios::ate);
+            end = segments.back() + (last.is_open() ? (long long)last.tellg() : 0);
+        }
+        for (auto &entry : users)
+        {
+            end = std::max(end, entry.second.start);
+        }
+        last_expire = 0;
+        expire();
+    }
+
+    // 用户离线，从当前日志末尾开始为其保存消息
+    void set_offline(const std::string &nickname)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!closed)
+        {
+            users.emplace(nickname, User{end, now()});
+        }
+    }
+
+    // 有用户离线时把消息追加到共享日志
+    void enqueue(const std::string &msg)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed || users.empty())
+        {
+            return;
+        }
+        expire();
+        if (users.empty())
+        {
+            return;
+        }
+
+        // 新分段截断打开，不会接在同名的旧文件后面；交接得到的最后一段则继续追加
+        if (segments.empty() || end - segments.back() >= OFFLINE_SEGMENT_SIZE)
+        {
+            out.close();
+            segments.push_back(end);
+            out.open(segment_path(segments.back()), std::ios::binary | std::ios::trunc);
+        }
+        else if (!out.is_open())
+        {
+            out.open(segment_path(segments.back()), std::ios::binary | std::ios::app);
+        }
+        uint32_t len = (uint32_t)msg.size();
+        out.write(reinterpret_cast<const char *>(&len), sizeof(len));
+        out.write(msg.data(), len);
+        end += sizeof(len) + len;
+    }
+
+    // 用户重新上线：取出离线期间的消息（按时间顺序，最多 OFFLINE_REPLAY_LIMIT 字节），并停止为其保存
+    std::vector<std::string> take(const std::string &nickname, size_t &dropped)
+    {
+        std::deque<std::string> messages;
+        long long bytes = 0;
+        dropped = 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = users.find(nickname);
+        if (it == users.end())
+        {
+            return {};
+        }
+        long long start = it->second.start;
+        users.erase(it);
+        out.flush();
+
+        // 从包含起始位置的段开始顺序读取，记录不会跨段
+        size_t first = std::upper_bound(segments.begin(), segments.end(), start) - segments.begin();
+        for (size_t i = first == 0 ? 0 : first - 1; i < segments.size(); ++i)
+        {
+            std::ifstream file(segment_path(segments[i]), std::ios::binary | std::ios::ate);
+            long long remaining = file.is_open() ? (long long)file.tellg() : 0;
+            long long offset = std::max(0LL, start - segments[i]);
+            file.seekg(offset);
+            remaining -= offset;
+            uint32_t len = 0;
+            while (remaining >= (long long)sizeof(len) && file.read(reinterpret_cast<char *>(&len), sizeof(len)))
+            {
+                // 长度超出分段剩余字节说明记录不完整或已损坏，丢弃该段其余部分
+                remaining -= sizeof(len);
+                if ((long long)len > remaining)
+                    break;
+                remaining -= len;
+                std::string msg(len, '\0');
+                if (!file.read(&msg[0], len))
+                    break;
+                bytes += len;
+                messages.push_back(std::move(msg));
+                while (bytes > OFFLINE_REPLAY_LIMIT)
+                {
+                    bytes -= messages.front().size();
+                    messages.pop_front();
+                    ++dropped;
+                }
+            }
+        }
+        collect();
+        return std::vector<std::string>(std::make_move_iterator(messages.begin()), std::make_move_iterator(messages.end()));
+    }
+
+    // 交接前落盘并记录离线用户和日志分段，之后本进程不再写入
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        out.close();
+        std::ofstream index(index_path(), std::ios::trunc);
+        for (long long start : segments)
+        {
+            index << "SEG " << start << "\n";
+        }
+        for (auto &entry : users)
+        {
+            index << "USER " << hex_encode(entry.first) << " " << entry.second.start << " " << entry.second.since << "\n";
+        }
+    }
+};
+
+// 聊天记录全文检索
+const char SEARCH_DIR[] = "search";
+const size_t SEARCH_MAX_RESULTS = 20; // 每次搜索最多返回的条数（取最新的）
+
+// 聊天记录全文检索：消息追加写入日志文件，内存中维护倒排索引
+// 英文和数字按单词（不区分大小写）索引，其他文字按单字和相邻双字索引
+// 倒排表按文档编号升序、差值变长编码压缩，新消息直接追加到表尾
+class SearchIndex
+{
+private:
+    // 一个词的倒排表
+    struct Postings
+    {
+        std::string bytes; // 文档编号差值的变长编码
+        uint32_t last = 0; // 最后一个文档编号
+        uint32_t count = 0;
+    };
+
+    // 倒排表的顺序解码器
+    struct Cursor
+    {
+        const Postings *list;
+        size_t pos = 0;
+        uint32_t doc = 0;
+
+        explicit Cursor(const Postings *list) : list(list) {}
+
+        bool next()
+        {
+            if (pos >= list->bytes.size())
+                return false;
+            uint32_t delta = 0;
+            int shift = 0;
+            unsigned char byte;
+            do
+            {
+                byte = (unsigned char)list->bytes[pos++];
+                delta |= (uint32_t)(byte & 0x7f) << shift;
+                shift += 7;
+            } while ((byte & 0x80) && pos < list->bytes.size());
+            doc += delta;
+            return true;
+        }
+    };
+
+    std::string dir;
+    std::unordered_map<std::string, Postings> terms;
+    std::vector<uint64_t> offsets;   // 文档编号到日志文件偏移
+    std::vector<long long> times;    // 文档编号到发送时间（非递减，可二分查找）
+    std::ofstream log;
+    uint64_t log_end;
+    bool caught_up;
+    std::mutex mutex;
+
+    std::string log_path() const
+    {
+        return dir + "\\messages.log";
+    }
+
+    static void add_posting(Postings &list, uint32_t doc)
+    {
+        if (list.count > 0 && list.last == doc)
+            return; // 同一条消息中重复出现的词
+        uint32_t delta = doc - (list.count > 0 ? list.last : 0);
+        while (delta >= 0x80)
+        {
+            list.bytes += (char)(delta | 0x80);
+            delta >>= 7;
+        }
+        list.bytes += (char)delta;
+        list.last = doc;
+        ++list.count;
+    }
+
+    // 切分检索词：英文数字按单词小写，其他字符按单字和相邻双字
+    // 查询时连续两个以上的字只需双字即可定位，不再用单字
+    static std::vector<std::string> tokenize(const std::string &text, bool for_query = false)
+    {
+        std::vector<std::string> tokens;
+        std::string word;
+        std::vector<std::string> run; // 连续的非ASCII字符
+        auto flush_word = [&]()
+        {
+            if (!word.empty())
+                tokens.push_back(std::move(word));
+            word.clear();
+        };
+        auto flush_run = [&]()
+        {
+            for (size_t i = 0; i < run.size(); ++i)
+            {
+                if (!for_query || run.size() == 1)
+                    tokens.push_back(run[i]);
+                if (i + 1 < run.size())
+                    tokens.push_back(run[i] + run[i + 1]);
+            }
+            run.clear();
+        };
+
+        for (size_t i = 0; i < text.size();)
+        {
+            unsigned char c = (unsigned char)text[i];
+            if (c < 0x80)
+            {
+                flush_run();
+                if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z'))
+                    word += (char)c;
+                else if (c >= 'A' && c <= 'Z')
+                    word += (char)(c - 'A' + 'a');
+                else
+                    flush_word();
+                ++i;
+                continue;
+            }
+
+            flush_word();
+            size_t len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+            std::string ch = text.substr(i, len);
+            i += len;
+            // 中文标点不参与索引
+            if (ch == "，" || ch == "。" || ch == "！" || ch == "？" || ch == "：" || ch == "；" || ch == "、")
+                flush_run();
+            else
+                run.push_back(std::move(ch));
+        }
+        flush_word();
+        flush_run();
+        return tokens;
+    }
+
+    static std::string nickname_term(const std::string &nickname)
+    {
+        return "\x01" + nickname;
+    }
+
+    void index_document(uint32_t doc, const std::string &nickname, const std::string &text)
+    {
+        add_posting(terms[nickname_term(nickname)], doc);
+        for (const std::string &token : tokenize(text))
+        {
+            add_posting(terms[token], doc);
+        }
+    }
+
+    // 日志记录：长度(4字节) + 时间(8字节) + 昵称长度(2字节) + 昵称 + 消息
+    // 记录须完整位于 file_end 之前，长度字段损坏或记录写了一半时返回false
+    bool read_record(std::ifstream &file, uint64_t offset, uint64_t file_end, long long &time, std::string &nickname, std::string &text)
+    {
+        uint32_t len = 0;
+        uint16_t nick_len = 0;
+        file.clear();
+        file.seekg((std::streamoff)offset);
+        if (!file.read(reinterpret_cast<char *>(&len), sizeof(len)) || len < sizeof(time) + sizeof(nick_len) ||
+            offset + sizeof(len) + len > file_end ||
+            !file.read(reinterpret_cast<char *>(&time), sizeof(time)) ||
+            !file.read(reinterpret_cast<char *>(&nick_len), sizeof(nick_len)) ||
+            len < sizeof(time) + sizeof(nick_len) + nick_len)
+            return false;
+        nickname.resize(nick_len);
+        text.resize(len - sizeof(time) - sizeof(nick_len) - nick_len);
+        return (bool)file.read(&nickname[0], nick_len) && (bool)file.read(&text[0], text.size());
+    }
+
+    // 索引日志中尚未索引的记录（热重启时旧进程在交接前可能还写入过消息）
+    // truncate 为true时截掉末尾不完整的记录；旧进程可能仍在写入时（接管完成前）不能截断
+    void scan(bool truncate)
+    {
+        std::ifstream file(log_path(), std::ios::binary | std::ios::ate);
+        uint64_t file_end = file.is_open() ? (uint64_t)file.tellg() : 0;
+        long long time;
+        std::string nickname, text;
+        while (file.is_open() && read_record(file, log_end, file_end, time, nickname, text))
+        {
+            uint32_t doc = (uint32_t)offsets.size();
+            offsets.push_back(log_end);
+            times.push_back(times.empty() ? time : std::max(time, times.back()));
+            index_document(doc, nickname, text);
+            log_end = (uint64_t)file.tellg();
+        }
+        file.close();
+        if (!truncate)
+            return;
+
+        // 截掉异常退出留下的半条记录
+        std::error_code ec;
+        if (std::filesystem::exists(log_path(), ec) && std::filesystem::file_size(log_path(), ec) > log_end)
+        {
+            std::filesystem::resize_file(log_path(), log_end, ec);
+        }
+    }
+
+    // 首次写入或搜索前：补上交接期间旧进程写入的记录，截掉不完整的尾部，再打开日志追加
+    void catch_up()
+    {
+        if (caught_up)
+            return;
+        caught_up = true;
+        scan(true);
+        log.open(log_path(), std::ios::binary | std::ios::app);
+    }
+
+public:
+    explicit SearchIndex(const std::string &dir) : dir(dir), log_end(0), caught_up(false) {}
+
+    // 创建目录并从日志重建索引
+    void init()
+    {
+        CreateDirectoryA(dir.c_str(), NULL);
+        std::lock_guard<std::mutex> lock(mutex);
+        // 此时旧进程可能还在追加，只索引完整的记录，不截断也不打开日志
+        scan(false);
+    }
+
+    // 记录并索引一条聊天消息
+    void add(const std::string &nickname, const std::string &text)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        catch_up();
+
+        long long time = (long long)std::time(nullptr);
+        if (!times.empty())
+            time = std::max(time, times.back());
+        uint16_t nick_len = (uint16_t)std::min<size_t>(nickname.size(), 0xffff);
+        uint32_t len = (uint32_t)(sizeof(time) + sizeof(nick_len) + nick_len + text.size());
+        log.write(reinterpret_cast<const char *>(&len), sizeof(len));
+        log.write(reinterpret_cast<const char *>(&time), sizeof(time));
+        log.write(reinterpret_cast<const char *>(&nick_len), sizeof(nick_len));
+        log.write(nickname.data(), nick_len);
+        log.write(text.data(), text.size());
+        log.flush();
+        if (!log)
+        {
+            log.clear();
+            return;
+        }
+
+        uint32_t doc = (uint32_t)offsets.size();
+        offsets.push_back(log_end);
+        times.push_back(time);
+        log_end += sizeof(len) + len;
+        index_document(doc, nickname.substr(0, nick_len), text);
+    }
+
+    // 搜索：关键词全部出现，可按昵称和时间范围 [since, until) 过滤（0表示不限）
+    // 返回匹配总数，results 为最新的至多 limit 条（按时间先后排列）
+    size_t search(const std::string &query, const std::string &nickname, long long since, long long until,
+                  size_t limit, std::vector<std::string> &results)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        catch_up();
+
+        // 时间范围换算成文档编号范围
+        uint32_t lo = since > 0 ? (uint32_t)(std::lower_bound(times.begin(), times.end(), since) - times.begin()) : 0;
+        uint32_t hi = until > 0 ? (uint32_t)(std::lower_bound(times.begin(), times.end(), until) - times.begin())
+                                : (uint32_t)times.size();
+        if (lo >= hi)
+            return 0;
+
+        std::vector<std::string> words = tokenize(query, true);
+        if (!nickname.empty())
+            words.push_back(nickname_term(nickname));
+
+        std::vector<uint32_t> docs;
+        if (words.empty())
+        {
+            for (uint32_t doc = hi - std::min<uint32_t>(hi - lo, (uint32_t)limit); doc < hi; ++doc)
+                docs.push_back(doc);
+        }
+        else
+        {
+            // 从最短的倒排表开始求交集
+            std::vector<const Postings *> lists;
+            for (const std::string &word : words)
+            {
+                auto it = terms.find(word);
+                if (it == terms.end())
+                    return 0;
+                lists.push_back(&it->second);
+            }
+            std::sort(lists.begin(), lists.end(), [](const Postings *a, const Postings *b)
+                      { return a->count < b->count; });
+
+            Cursor first(lists[0]);
+            while (first.next())
+            {
+                if (first.doc >= hi)
+                    break;
+                if (first.doc >= lo)
+                    docs.push_back(first.doc);
+            }
+            for (size_t i = 1; i < lists.size() && !docs.empty(); ++i)
+            {
+                Cursor cursor(lists[i]);
+                size_t kept = 0, j = 0;
+                bool more = cursor.next();
+                while (more && j < docs.size())
+                {
+                    if (cursor.doc < docs[j])
+                        more = cursor.next();
+                    else if (cursor.doc > docs[j])
+                        ++j;
+                    else
+                    {
+                        docs[kept++] = docs[j++];
+                        more = cursor.next();
+                    }
+                }
+                docs.resize(kept);
+            }
+        }
+
+        size_t total = words.empty() ? hi - lo : docs.size();
+        std::ifstream file(log_path(), std::ios::binary);
+        for (size_t i = docs.size() - std::min(docs.size(), limit); i < docs.size(); ++i)
+        {
+            long long time;
+            std::string author, text;
+            if (!read_record(file, offsets[docs[i]], log_end, time, author, text))
+                continue;
+            time_t t = (time_t)time;
+            char stamp[32];
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", localtime(&t));
+            results.push_back(std::string("[") + stamp + "] [" + author + "]: " + text);
+        }
+        return total;
+    }
+};
+
+// 会话恢复参数
+const size_t HISTORY_SIZE = 1024;    // 为断线重连保留的最近广播消息条数
+const int RESUME_GRACE_SECONDS = 30; // 断线后保留会话、暂不通知离开的时间
+
+// 最近广播过的一条消息
+struct HistoryEntry
+{
+    uint64_t seq;
+    std::string sender; // 发送者昵称（重连时不补发自己发的消息）
+    std::string wire;   // 发给客户端的内容（MSG 序号 消息）
+};
+
+// 取出 "MSG 序号 消息" 中的序号，格式不符返回0
+uint64_t messageSeq(const std::string &wire)
+{
+    if (wire.compare(0, 4, "MSG ") != 0)
+    {
+        return 0;
+    }
+    return std::strtoull(wire.c_str() + 4, nullptr, 10);
+}
+
+// 等待上传完成的共享文件
+struct PendingShare
+{
+    SOCKET uploader;                                     // 负责上传的连接
+    long long size;                                      // 声明的文件大小
+    std::vector<std::pair<SOCKET, std::string>> sharers; // 上传完成后要发布的分享（连接、文件名）
+};
+
+// 自定义服务器类，重写on_receive方法
+class ChatTCPServer : public TCPServer
+{
+private:
+    std::string server_id;
+    std::string peer_secret;            // 对等服务器之间的共享密钥（--peer-secret）
+    std::vector<SOCKET> resync_peers;   // 接管得到的对等链路，启动后请对端重新同步
+    std::map<SOCKET, PeerLink> peers; // 对等服务器链路
+    std::mutex peers_mutex;           // 保护对等链路的互斥锁
+    BlobStore blobs;
+    std::map<std::string, PendingShare> pending_shares; // 哈希到等待上传的分享
+    std::map<std::string, std::string> blob_names;      // 哈希到最近一次分享时的文件名
+    std::mutex shares_mutex;                            // 保护分享状态的互斥锁
+    OfflineStore offline;                               // 离线用户的消息队列
+    SearchIndex search_index;                           // 聊天记录全文检索
+    std::atomic<uint64_t> next_seq;                     // 下一条广播消息的序号
+    std::deque<HistoryEntry> history;                   // 最近广播的消息，供断线重连补发
+    std::mutex history_mutex;
+    std::map<std::string, std::string> session_tokens;  // 会话令牌到昵称
+    std::map<std::string, std::string> nickname_tokens; // 昵称到会话令牌
+    std::map<std::string, std::chrono::steady_clock::time_point> suspended; // 断线后等待重连的昵称及宽限期截止时刻
+    std::mutex tokens_mutex;                                                  // 保护会话令牌的互斥锁
+    std::condition_variable sweeper_cv;                                       // 通知宽限期检查线程退出
+    bool sweeper_stopping;
+    std::thread sweeper;                                                      // 宽限期检查线程
+
+    // 生成新的会话令牌
+    static std::string new_token()
+    {
+        static std::mutex rng_mutex;
+        static std::mt19937_64 rng(std::random_device{}() ^
+                                   (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count());
+        std::lock_guard<std::mutex> lock(rng_mutex);
+        char buf[33];
+        snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)rng(), (unsigned long long)rng());
+        return buf;
+    }
+
+    // 为昵称签发会话令牌（替换旧令牌），返回该昵称是否正处于断线宽限期
+    bool issue_token(const std::string &nickname, std::string &token)
+    {
+        token = new_token();
+        std::lock_guard<std::mutex> lock(tokens_mutex);
+        auto it = nickname_tokens.find(nickname);
+        if (it != nickname_tokens.end())
+        {
+            session_tokens.erase(it->second);
+        }
+        nickname_tokens[nickname] = token;
+        session_tokens[token] = nickname;
+        return suspended.erase(nickname) > 0;
+    }
+
+    // 主动退出时作废会话令牌
+    void revoke_token(const std::string &nickname)
+    {
+        std::lock_guard<std::mutex> lock(tokens_mutex);
+        auto it = nickname_tokens.find(nickname);
+        if (it != nickname_tokens.end())
+        {
+            session_tokens.erase(it->second);
+            nickname_tokens.erase(it);
+        }
+        suspended.erase(nickname);
+    }
+
+    // 断线：保留会话一段时间，期间重连则不通知离开（到期由 sweep_suspended 处理）
+    void suspend_session(const std::string &nickname)
+    {
+        std::lock_guard<std::mutex> lock(tokens_mutex);
+        suspended[nickname] = std::chrono::steady_clock::now() + std::chrono::seconds(RESUME_GRACE_SECONDS);
+    }
+
+    // 宽限期检查线程：每秒检查一次，为超过宽限期仍未重连的用户通知离开
+    void sweep_suspended()
+    {
+        std::unique_lock<std::mutex> lock(tokens_mutex);
+        while (!sweeper_cv.wait_for(lock, std::chrono::seconds(1), [this]
+                                    { return sweeper_stopping; }))
+        {
+            // 连接已交给新进程后不再广播
+            if (is_handed_off())
+            {
+                continue;
+            }
+            std::vector<std::string> expired;
+            auto now = std::chrono::steady_clock::now();
+            for (auto it = suspended.begin(); it != suspended.end();)
+            {
+                if (it->second <= now)
+                {
+                    expired.push_back(it->first);
+                    it = suspended.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            if (expired.empty())
+            {
+                continue;
+            }
+
+            // 广播时不持有令牌锁
+            lock.unlock();
+            for (const std::string &nickname : expired)
+            {
+                log_info("用户 " + nickname + " 离开聊天");
+                broadcast_local(INVALID_SOCKET, "系统消息: " + nickname + " 离开了聊天");
+                send_to_peers("LEAVE " + nickname);
+            }
+            lock.lock();
+        }
+    }
+
+    // RESUME 令牌 最后收到的序号：恢复会话并只补发缺失的消息
+    void handle_resume(SOCKET client_sock, const std::string &client_ip, const std::string &args)
+    {
+        size_t space = args.find(' ');
+        std::string token = args.substr(0, space);
+        uint64_t last_seq = space == std::string::npos ? 0 : std::strtoull(args.c_str() + space + 1, nullptr, 10);
+
+        std::string nickname;
+        bool was_suspended = false;
+        {
+            std::lock_guard<std::mutex> lock(tokens_mutex);
+            auto it = session_tokens.find(token);
+            if (it != session_tokens.end())
+            {
+                nickname = it->second;
+                was_suspended = suspended.erase(nickname) > 0;
+            }
+        }
+        if (nickname.empty())
+        {
+            send_data(client_sock, "RESUME_FAILED");
+            return;
+        }
+
+        // 取出缺失的消息、绑定新连接并补发在同一把锁内完成，期间的广播不会漏掉，也不会先于补发的消息到达
+        bool replaced = false;
+        size_t delta_count = 0;
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+
+            // 缺失的消息 = 离线消息 + 断线前最近广播的消息，按序号去重
+            size_t dropped = 0;
+            std::map<uint64_t, std::string> delta;
+            for (std::string &wire : offline.take(nickname, dropped))
+            {
+                uint64_t seq = messageSeq(wire);
+                if (seq > last_seq)
+                {
+                    delta[seq] = std::move(wire);
+                }
+            }
+            bool gap = false;
+            {
+                std::lock_guard<std::mutex> history_lock(history_mutex);
+                gap = !history.empty() && history.front().seq > last_seq + 1 &&
+                      (delta.empty() || delta.begin()->first > history.front().seq);
+                for (const HistoryEntry &entry : history)
+                {
+                    if (entry.seq > last_seq && entry.sender != nickname)
+                    {
+                        delta[entry.seq] = entry.wire;
+                    }
+                }
+            }
+
+            // 把昵称绑定到新连接（旧连接可能尚未被发现断开）
+            for (auto it = clients.begin(); it != clients.end();)
+            {
+                if (client_nicknames[*it] == nickname)
+                {
+                    it = clients.erase(it);
+                    replaced = true;
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            clients.insert(client_sock);
+            client_nicknames[client_sock] = nickname;
+            client_states[client_sock] = ClientState::NICKNAME_SET;
+
+            std::vector<std::string> batch;
+            batch.push_back("RESUMED " + nickname);
+            if (gap || dropped > 0)
+            {
+                batch.push_back("系统消息: 部分消息已超出保留范围，无法补发");
+            }
+            for (auto &entry : delta)
+            {
+                batch.push_back(std::move(entry.second));
+            }
+            send_batch(client_sock, batch);
+            delta_count = delta.size();
+        }
+        log_info("用户 " + nickname + " 恢复会话，补发 " + std::to_string(delta_count) + " 条消息");
+
+        // 超过保留时间才重连的，离开通知已经发出，需要重新通知加入
+        if (!was_suspended && !replaced)
+        {
+            broadcast_local(client_sock, "系统消息: " + nickname + " 加入了聊天");
+            send_to_peers("JOIN " + nickname);
+        }
+    }
+
+    // 在聊天室发布一个已入库的共享文件
+    // 共享文件只存放在本服务器，因此不转发给对等服务器
+    void announce_share(SOCKET sharer, const std::string &client_ip, const std::string &hash,
+                        const std::string &name, long long size)
+    {
+        {
+            std::lock_guard<std::mutex> lock(shares_mutex);
+            blob_names[hash] = name;
+        }
+        std::string nickname = getNickname(sharer, client_ip);
+        log_info("用户 " + nickname + " 分享了文件 " + name + " (" + hash + ")");
+        broadcast_local(sharer, "系统消息: " + nickname + " 分享了文件 " + name + " (" + std::to_string(size) +
+                                    " 字节)，输入 /get " + hash + " 下载");
+        send_data(sharer, "SHARE_OK " + hash);
+    }
+
+    // SHARE 哈希 大小 文件名：库中已有该内容时直接发布，否则请分享者上传一次
+    void handle_share(SOCKET client_sock, const std::string &client_ip, const std::string &args)
+    {
+        size_t pos1 = args.find(' ');
+        size_t pos2 = pos1 == std::string::npos ? std::string::npos : args.find(' ', pos1 + 1);
+        std::string hash = args.substr(0, pos1);
+        if (pos2 == std::string::npos || !is_content_hash(hash))
+        {
+            send_data(client_sock, "系统消息: 分享格式错误");
+            return;
+        }
+        long long size = std::atoll(args.substr(pos1 + 1, pos2 - pos1 - 1).c_str());
+        std::string name = file_basename(args.substr(pos2 + 1));
+
+        // 库中已有时按实际大小发布，不采信客户端声明的大小
+        long long stored_size = 0;
+        if (blobs.contains(hash, stored_size))
+        {
+            announce_share(client_sock, client_ip, hash, name, stored_size);
+            return;
+        }
+
+        bool need_upload = false;
+        {
+            std::lock_guard<std::mutex> lock(shares_mutex);
+            auto it = pending_shares.find(hash);
+            if (it == pending_shares.end())
+            {
+                PendingShare &pending = pending_shares[hash];
+                pending.uploader = client_sock;
+                pending.size = size;
+                need_upload = true;
+                it = pending_shares.find(hash);
+            }
+            it->second.sharers.push_back(std::make_pair(client_sock, name));
+        }
+        // 同一内容已有人在上传时，等它上传完成后一起发布
+        if (need_upload)
+        {
+            send_data(client_sock, "SHARE_UPLOAD " + hash);
+        }
+    }
+
+    // GET 哈希：从共享映射发送文件
+    void handle_get(SOCKET client_sock, const std::string &hash)
+    {
+        std::shared_ptr<const MappedFile> blob = is_content_hash(hash) ? blobs.open(hash) : nullptr;
+        if (!blob)
+        {
+            send_data(client_sock, "系统消息: 共享文件不存在");
+            return;
+        }
+
+        std::string name = hash;
+        {
+            std::lock_guard<std::mutex> lock(shares_mutex);
+            auto it = blob_names.find(hash);
+            if (it != blob_names.end())
+            {
+                name = it->second;
+            }
+        }
+        send_shared_file(client_sock, blob, name);
+    }
+
+    // 解析搜索日期（YYYY-MM-DD，本地时间），返回当天零点的时间戳，格式不符返回-1
+    static long long parse_date(const std::string &date)
+    {
+        struct tm tm_date = {};
+        if (sscanf(date.c_str(), "%d-%d-%d", &tm_date.tm_year, &tm_date.tm_mon, &tm_date.tm_mday) != 3)
+        {
+            return -1;
+        }
+        tm_date.tm_year -= 1900;
+        tm_date.tm_mon -= 1;
+        tm_date.tm_isdst = -1;
+        return (long long)mktime(&tm_date);
+    }
+
+    // SEARCH 关键词... [from:昵称] [since:YYYY-MM-DD] [until:YYYY-MM-DD]
+    void handle_search(SOCKET client_sock, const std::string &args)
+    {
+        std::string query, nickname;
+        long long since = 0, until = 0;
+        std::istringstream in(args);
+        std::string word;
+        while (in >> word)
+        {
+            if (word.compare(0, 5, "from:") == 0)
+            {
+                nickname = word.substr(5);
+            }
+            else if (word.compare(0, 6, "since:") == 0 || word.compare(0, 6, "until:") == 0)
+            {
+                long long day = parse_date(word.substr(6));
+                if (day < 0)
+                {
+                    send_data(client_sock, "系统消息: 日期格式应为 YYYY-MM-DD");
+                    return;
+                }
+                if (word[0] == 's')
+                    since = day;
+                else
+                    until = day + 24 * 60 * 60; // 包含当天
+            }
+            else
+            {
+                query += word + " ";
+            }
+        }
+        if (query.empty() && nickname.empty() && since == 0 && until == 0)
+        {
+            send_data(client_sock, "系统消息: 用法 SEARCH 关键词 [from:昵称] [since:YYYY-MM-DD] [until:YYYY-MM-DD]");
+            return;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::string> results;
+        size_t total = search_index.search(query, nickname, since, until, SEARCH_MAX_RESULTS, results);
+        long long elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+        results.insert(results.begin(), "搜索结果: 共 " + std::to_string(total) + " 条，显示最近 " +
+                                            std::to_string(results.size()) + " 条 (" + std::to_string(elapsed) + " ms)");
+        send_batch(client_sock, results);
+    }
+
+    // 把消息编上序号发给本服务器上的客户端（除了发送者），并为离线用户和断线重连保存
+    void broadcast_local(SOCKET sender, const std::string &msg)
+    {
+        HistoryEntry entry;
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            entry.seq = next_seq++;
+            entry.wire = "MSG " + std::to_string(entry.seq) + " " + msg;
+            auto nick_it = client_nicknames.find(sender);
+            if (nick_it != client_nicknames.end())
+            {
+                entry.sender = nick_it->second;
+            }
+            for (SOCKET client : clients)
+            {
+                if (client != sender)
+                {
+                    send_data(client, entry.wire);
+                }
+            }
+            // 离线保存和历史记录也在锁内完成，上线/恢复会话时取到的内容与直接收到的消息恰好衔接
+            offline.enqueue(entry.wire);
+
+            std::lock_guard<std::mutex> history_lock(history_mutex);
+            history.push_back(std::move(entry));
+            if (history.size() > HISTORY_SIZE)
+            {
+                history.pop_front();
+            }
+        }
+    }
+
+    // 取出离线期间的消息，开头附上提示；没有离线消息时返回空（调用方持有 clients_mutex）
+    std::vector<std::string> take_offline(const std::string &nickname)
+    {
+        size_t dropped = 0;
+        std::vector<std::string> messages = offline.take(nickname, dropped);
+        if (messages.empty() && dropped == 0)
+        {
+            return messages;
+        }
+
+        std::string notice = "系统消息: 你离线期间有 " + std::to_string(messages.size()) + " 条消息";
+        if (dropped > 0)
+        {
+            notice += "（另有 " + std::to_string(dropped) + " 条因超出保存上限被丢弃）";
+        }
+        messages.insert(messages.begin(), notice);
+        return messages;
+    }
+
+    // 向每个对等服务器发送一行（每个对端一次，而不是每个远端用户一次）
+    void send_to_peers(std::string line)
+    {
+        std::replace(line.begin(), line.end(), '\n', ' ');
+        std::replace(line.begin(), line.end(), '\r', ' ');
+        line += "\n";
+        std::lock_guard<std::mutex> lock(peers_mutex);
+        for (auto &entry : peers)
+        {
+            send_data(entry.first, line);
+        }
+    }
+
+    // 本服务器在线用户快照（对端据此建立初始在线列表）
+    std::string presence_snapshot()
+    {
+        std::string snapshot;
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        for (SOCKET client : clients)
+        {
+            // 昵称在设置时已拒绝控制字符，这里再跳过一次，防止向对等链路注入命令
+            const std::string &nickname = client_nicknames[client];
+            if (isValidNickname(nickname))
+            {
+                snapshot += "SYNC " + nickname + "\n";
+            }
+        }
+        return snapshot;
+    }
+
+    // 昵称是否在某个对端服务器上在线（调用者持有 peers_mutex）
+    bool online_on_peers(const std::string &nickname, SOCKET except = INVALID_SOCKET)
+    {
+        for (auto &entry : peers)
+        {
+            if (entry.first != except && entry.second.nicknames.count(nickname) > 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool is_peer(SOCKET sock)
+    {
+        std::lock_guard<std::mutex> lock(peers_mutex);
+        return peers.find(sock) != peers.end();
+    }
+
+    bool has_peer_addr(const std::string &addr)
+    {
+        std::lock_guard<std::mutex> lock(peers_mutex);
+        for (auto &entry : peers)
+        {
+            if (entry.second.addr == addr)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 处理对等链路上的数据：按行拆分后逐行处理
+    bool handle_peer_data(SOCKET peer_sock, const std::string &data)
+    {
+        std::vector<std::string> lines;
+        {
+            std::lock_guard<std::mutex> lock(peers_mutex);
+            auto it = peers.find(peer_sock);
+            if (it == peers.end())
+            {
+                return false;
+            }
+            std::string &pending = it->second.pending;
+            pending += data;
+            size_t start = 0, pos;
+            while ((pos = find_byte(pending, '\n', start)) != std::string::npos)
+            {
+                lines.push_back(pending.substr(start, pos - start));
+                start = pos + 1;
+            }
+            pending.erase(0, start);
+        }
+
+        for (const std::string &line : lines)
+        {
+            if (!handle_peer_line(peer_sock, line))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // 对等链路的握手行：PEER 标识 密钥
+    std::string peer_hello() const
+    {
+        return "PEER " + server_id + " " + peer_secret + "\n";
+    }
+
+    // 对等链路协议：PEER 标识 密钥 / SYNC 昵称 / JOIN 昵称 / LEAVE 昵称 / MSG 消息 / RESYNC
+    // 对端必须先以 PEER 出示正确的密钥，之后的命令才会被处理
+    bool handle_peer_line(SOCKET peer_sock, const std::string &line)
+    {
+        size_t space = line.find(' ');
+        std::string command = line.substr(0, space);
+        std::string arg = space == std::string::npos ? "" : line.substr(space + 1);
+
+        {
+            std::lock_guard<std::mutex> lock(peers_mutex);
+            auto it = peers.find(peer_sock);
+            if (it == peers.end())
+            {
+                return false;
+            }
+            PeerLink &peer = it->second;
+            if (command == "PEER")
+            {
+                size_t id_end = arg.find(' ');
+                std::string id = arg.substr(0, id_end);
+                std::string secret = id_end == std::string::npos ? "" : arg.substr(id_end + 1);
+                if (!peerSecretMatches(secret, peer_secret))
+                {
+                    log_error("对等服务器 " + id + " 的密钥不正确，断开链路");
+                    return false;
+                }
+                if (id == server_id)
+                {
+                    log_error("拒绝连接到自身的对等链路");
+                    return false;
+                }
+                peer.id = id;
+                peer.verified = true;
+                log_info("对等服务器 " + peer.id + " 已连接");
+                return true;
+            }
+            if (!peer.verified)
+            {
+                log_error("对等链路未完成认证，断开");
+                return false;
+            }
+        }
+
+        if (command == "MSG")
+        {
+            // 其他服务器上用户的聊天消息（[昵称]: 消息）也加入检索
+            size_t close = arg.find("]: ");
+            if (!arg.empty() && arg[0] == '[' && close != std::string::npos)
+            {
+                search_index.add(arg.substr(1, close - 1), arg.substr(close + 3));
+            }
+            broadcast_local(INVALID_SOCKET, arg);
+            return true;
+        }
+        if (command == "RESYNC")
+        {
+            return send_data(peer_sock, presence_snapshot());
+        }
+
+        std::string announcement;
+        {
+            std::lock_guard<std::mutex> lock(peers_mutex);
+            auto it = peers.find(peer_sock);
+            if (it == peers.end())
+            {
+                return false;
+            }
+            PeerLink &peer = it->second;
+
+            // 链路（重新）建立后收到的在线列表：之前不在线的用户通知加入
+            if (command == "SYNC")
+            {
+                if (!online_on_peers(arg) && peer.nicknames.insert(arg).second)
+                {
+                    log_info("用户 " + arg + " 在服务器 " + peer.id + " 在线");
+                    announcement = "系统消息: " + arg + " 加入了聊天";
+                }
+            }
+            else if (command == "JOIN")
+            {
+                peer.nicknames.insert(arg);
+                log_info("用户 " + arg + " 在服务器 " + peer.id + " 加入聊天");
+                announcement = "系统消息: " + arg + " 加入了聊天";
+            }
+            else if (command == "LEAVE")
+            {
+                peer.nicknames.erase(arg);
+                log_info("用户 " + arg + " 在服务器 " + peer.id + " 离开聊天");
+                announcement = "系统消息: " + arg + " 离开了聊天";
+            }
+        }
+
+        // 释放对等链路锁后再广播，避免与客户端锁交叉持有
+        if (!announcement.empty())
+        {
+            broadcast_local(INVALID_SOCKET, announcement);
+        }
+        return true;
+    }
+
+    // 维持一条主动连出的对等链路，断开后按指数退避重连
+    void maintain_peer_link(std::string addr)
     {
-        ++start;
+        size_t colon = addr.rfind(':');
+        std::string peer_ip = addr.substr(0, colon);
+        int peer_port = std::atoi(addr.substr(colon + 1).c_str());
+        int retry_ms = PEER_RETRY_MIN_MS;
+
+        while (!is_handed_off())
+        {
+            if (!has_peer_addr(addr))
+            {
+                SOCKET sock = connect_to(peer_ip, peer_port);
+                if (sock != INVALID_SOCKET)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(peers_mutex);
+                        peers[sock].addr = addr;
+                    }
+                    // 先登记连接再发送，发送须经过该连接的发送器
+                    adopt_client(sock, "peer " + addr);
+                    send_data(sock, peer_hello() + presence_snapshot());
+                    retry_ms = PEER_RETRY_MIN_MS;
+                }
+                else
+                {
+                    log_debug("连接对等服务器 " + addr + " 失败，" + std::to_string(retry_ms / 1000) + " 秒后重试");
+                    retry_ms = std::min(retry_ms * 2, PEER_RETRY_MAX_MS);
+                }
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
+        }
     }
-    auto end = s.end();
-    do
+
+public:
+    ChatTCPServer(std::string ip = "0.0.0.0", int port = 8888)
+        : TCPServer(ip, port), server_id(std::to_string(port) + "-" + std::to_string(GetCurrentProcessId())), blobs(dataDir(BLOB_DIR, port)),
+          offline(dataDir(OFFLINE_DIR, port)), search_index(dataDir(SEARCH_DIR, port)), sweeper_stopping(false)
     {
-        --end;
-    } while (std::distance(start, end) > 0 && std::isspace(*end));
-    return std::string(start, end + 1);
-}
+        // 序号从启动时刻起编，热重启后仍然递增
+        next_seq = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count() *
+                   1000;
+        set_upload_dir(dataDir(DEFAULT_UPLOAD_DIR, port));
+        blobs.init();
+        search_index.init();
+        sweeper = std::thread(&ChatTCPServer::sweep_suspended, this);
+    }
 
-// 广播消息给所有客户端（除了发送者）
-void broadcast(SOCKET sender, const std::string &msg)
-{
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    for (SOCKET client : clients)
+    ~ChatTCPServer()
     {
-        if (client != sender)
         {
-            // 直接发送数据，不通过服务器实例
-            // 这里需要访问服务器实例来发送数据
+            std::lock_guard<std::mutex> lock(tokens_mutex);
+            sweeper_stopping = true;
+        }
+        sweeper_cv.notify_all();
+        if (sweeper.joinable())
+        {
+            sweeper.join();
         }
     }
-}
 
-// 获取客户端昵称
-std::string getNickname(SOCKET client_sock, const std::string &client_ip)
-{
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    auto it = client_nicknames.find(client_sock);
-    if (it != client_nicknames.end())
+    // 载入离线消息；热重启时须在接管完成后调用，此时旧进程已写好离线用户索引
+    void load_offline()
     {
-        return it->second;
+        offline.init();
     }
-    return client_ip;
-}
 
-// 自定义服务器类，重写on_receive方法
-class ChatTCPServer : public TCPServer
-{
-public:
-    ChatTCPServer(std::string ip = "0.0.0.0", int port = 8888) : TCPServer(ip, port) {}
+    // 等待中的分享不随连接交给新进程，通知分享者重新分享
+    void on_handing_off(SOCKET client_sock) override
+    {
+        std::vector<std::string> failed;
+        {
+            std::lock_guard<std::mutex> lock(shares_mutex);
+            for (auto it = pending_shares.begin(); it != pending_shares.end();)
+            {
+                auto &sharers = it->second.sharers;
+                size_t before = sharers.size();
+                sharers.erase(std::remove_if(sharers.begin(), sharers.end(), [client_sock](const std::pair<SOCKET, std::string> &sharer)
+                                             { return sharer.first == client_sock; }),
+                              sharers.end());
+                if (sharers.size() != before)
+                {
+                    failed.push_back(it->first);
+                }
+                if (sharers.empty())
+                {
+                    it = pending_shares.erase(it);
+                    continue;
+                }
+                ++it;
+            }
+        }
+        for (const std::string &hash : failed)
+        {
+            send_data(client_sock, "系统消息: 服务器正在重启，分享已取消，请稍后重新分享");
+            send_data(client_sock, "SHARE_FAILED " + hash);
+        }
+    }
+
+    // 交接给新进程前，把离线用户索引落盘供新进程继续使用
+    void on_handed_off() override
+    {
+        offline.close();
+    }
+
+    // 设置对等服务器之间的共享密钥；未设置时不接受也不建立对等链路
+    void set_peer_secret(const std::string &secret)
+    {
+        peer_secret = secret;
+    }
+
+    // 接管完成、开始服务后，请接管得到的对等链路重新同步在线用户
+    void on_started() override
+    {
+        for (SOCKET sock : resync_peers)
+        {
+            send_data(sock, peer_hello() + "RESYNC\n");
+        }
+        resync_peers.clear();
+    }
+
+    // 添加一个对等服务器（地址格式 IP:端口），由本服务器主动连接
+    void add_peer(const std::string &addr)
+    {
+        std::thread(&ChatTCPServer::maintain_peer_link, this, addr).detach();
+    }
+
+    // 热重启时导出会话状态（客户端：状态码\n昵称；对等链路：PEER\n对端地址）
+    std::string export_session(SOCKET client_sock) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(peers_mutex);
+            auto peer_it = peers.find(client_sock);
+            if (peer_it != peers.end())
+            {
+                // 对端的在线列表一并交接，重新同步时已知的用户不会再次通知加入
+                std::string state = "PEER\n" + peer_it->second.addr;
+                for (const std::string &nickname : peer_it->second.nicknames)
+                {
+                    state += "\n" + nickname;
+                }
+                return state;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        auto state_it = client_states.find(client_sock);
+        if (state_it == client_states.end())
+        {
+            return "";
+        }
+        std::string state = std::to_string((int)state_it->second) + "\n";
+        auto nick_it = client_nicknames.find(client_sock);
+        if (nick_it != client_nicknames.end())
+        {
+            state += nick_it->second;
+            std::lock_guard<std::mutex> token_lock(tokens_mutex);
+            auto token_it = nickname_tokens.find(nick_it->second);
+            if (token_it != nickname_tokens.end())
+            {
+                state += "\n" + token_it->second;
+            }
+        }
+        return state;
+    }
+
+    // 热重启时恢复会话状态
+    void import_session(SOCKET client_sock, const std::string &client_ip, const std::string &state) override
+    {
+        size_t pos = state.find('\n');
+        if (pos == std::string::npos)
+        {
+            return;
+        }
+
+        // 对等链路（旧进程已认证过）：地址后跟对端的在线列表；交接期间的变化在启动后请对端重新同步
+        if (state.substr(0, pos) == "PEER")
+        {
+            {
+                std::lock_guard<std::mutex> lock(peers_mutex);
+                PeerLink &peer = peers[client_sock];
+                std::istringstream lines(state.substr(pos + 1));
+                std::getline(lines, peer.addr);
+                std::string nickname;
+                while (std::getline(lines, nickname))
+                {
+                    peer.nicknames.insert(nickname);
+                }
+                peer.verified = true;
+            }
+            resync_peers.push_back(client_sock);
+            return;
+        }
+
+        // 昵称后可能跟着会话令牌
+        ClientState client_state = (ClientState)std::atoi(state.substr(0, pos).c_str());
+        std::string nickname = state.substr(pos + 1);
+        size_t token_pos = nickname.find('\n');
+        if (token_pos != std::string::npos)
+        {
+            std::string token = nickname.substr(token_pos + 1);
+            nickname.erase(token_pos);
+            std::lock_guard<std::mutex> lock(tokens_mutex);
+            nickname_tokens[nickname] = token;
+            session_tokens[token] = nickname;
+        }
+
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        client_states[client_sock] = client_state;
+        if (client_state == ClientState::NICKNAME_SET)
+        {
+            clients.insert(client_sock);
+            client_nicknames[client_sock] = nickname;
+        }
+    }
+
+    // 客户端上传完成：共享文件收入文件库并发布，普通上传通知聊天室
+    void on_file_received(SOCKET client_sock, const std::string &client_ip, const std::string &path, long long size) override
+    {
+        std::string hash = file_basename(path);
+        PendingShare pending;
+        bool is_share = false;
+        {
+            std::lock_guard<std::mutex> lock(shares_mutex);
+            auto it = pending_shares.find(hash);
+            if (it != pending_shares.end() && it->second.uploader == client_sock)
+            {
+                pending = it->second;
+                pending_shares.erase(it);
+                is_share = true;
+            }
+        }
+
+        if (is_share)
+        {
+            if (!blobs.add(path, hash))
+            {
+                log_error("共享文件内容与哈希不符 (" + client_ip + ")");
+                for (auto &sharer : pending.sharers)
+                {
+                    send_data(sharer.first, "系统消息: 上传的文件内容与哈希不符（上传过程中文件被修改？）");
+                    send_data(sharer.first, "SHARE_FAILED " + hash);
+                }
+                return;
+            }
+            for (auto &sharer : pending.sharers)
+            {
+                announce_share(sharer.first, client_ip, hash, sharer.second, size);
+            }
+            return;
+        }
+
+        TCPServer::on_file_received(client_sock, client_ip, path, size);
+        std::string nickname = getNickname(client_sock, client_ip);
+        std::string message = "系统消息: " + nickname + " 上传了文件 " + file_basename(path) + " (" + std::to_string(size) + " 字节)";
+        broadcast_local(client_sock, message);
+        send_to_peers("MSG " + message);
+    }
+
+    // 只有设置了昵称的客户端可以上传文件，对等链路和未登录的连接不行
+    bool accept_upload(SOCKET client_sock, const std::string &client_ip) override
+    {
+        if (is_peer(client_sock))
+        {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        auto it = client_states.find(client_sock);
+        return it != client_states.end() && it->second == ClientState::NICKNAME_SET;
+    }
+
+    // 连接断开：清理客户端或对等链路，并同步在线状态
+    void on_disconnect(SOCKET client_sock, const std::string &client_ip) override
+    {
+        // 对等链路断开：其上的用户（不在其他链路上的）通知离开，重连后随在线列表重新加入
+        bool was_peer = false;
+        std::vector<std::string> gone;
+        {
+            std::lock_guard<std::mutex> lock(peers_mutex);
+            auto peer_it = peers.find(client_sock);
+            if (peer_it != peers.end())
+            {
+                was_peer = true;
+                log_info("对等服务器 " + peer_it->second.id + " 已断开，移除其 " +
+                         std::to_string(peer_it->second.nicknames.size()) + " 个在线用户");
+                for (const std::string &nickname : peer_it->second.nicknames)
+                {
+                    if (!online_on_peers(nickname, client_sock))
+                    {
+                        gone.push_back(nickname);
+                    }
+                }
+                peers.erase(peer_it);
+            }
+        }
+        if (was_peer)
+        {
+            for (const std::string &nickname : gone)
+            {
+                broadcast_local(INVALID_SOCKET, "系统消息: " + nickname + " 离开了聊天");
+            }
+            return;
+        }
+
+        // 移除该连接等待中的分享；它负责上传的内容改由下一个分享者上传
+        std::vector<std::pair<SOCKET, std::string>> new_uploaders;
+        {
+            std::lock_guard<std::mutex> lock(shares_mutex);
+            for (auto it = pending_shares.begin(); it != pending_shares.end();)
+            {
+                PendingShare &pending = it->second;
+                auto &sharers = pending.sharers;
+                sharers.erase(std::remove_if(sharers.begin(), sharers.end(), [client_sock](const std::pair<SOCKET, std::string> &sharer)
+                                             { return sharer.first == client_sock; }),
+                              sharers.end());
+                if (sharers.empty())
+                {
+                    it = pending_shares.erase(it);
+                    continue;
+                }
+                if (pending.uploader == client_sock)
+                {
+                    pending.uploader = sharers.front().first;
+                    new_uploaders.push_back(std::make_pair(pending.uploader, it->first));
+                }
+                ++it;
+            }
+        }
+        for (auto &entry : new_uploaders)
+        {
+            send_data(entry.first, "SHARE_UPLOAD " + entry.second);
+        }
+
+        // 未发送exit就断开的客户端
+        std::string nickname;
+        {
+            std::lock_guard<std::mutex> lock(clients_mutex);
+            if (clients.erase(client_sock) > 0)
+            {
+                nickname = client_nicknames[client_sock];
+                // 在同一把锁内开始保存离线消息，之后的广播不会漏掉
+                offline.set_offline(nickname);
+            }
+            client_nicknames.erase(client_sock);
+            client_states.erase(client_sock);
+        }
+        // 离开通知等重连宽限期过后再发
+        if (!nickname.empty())
+        {
+            suspend_session(nickname);
+        }
+    }
 
     // 重写接收数据处理函数
     bool on_receive(SOCKET client_sock, const std::string &client_ip, const std::string &data) override
     {
+        // 来自对等服务器的数据
+        if (is_peer(client_sock))
+        {
+            return handle_peer_data(client_sock, data);
+        }
+
+        // 其他服务器主动连入：只接受连接上的第一条消息，且必须出示正确的密钥
+        if (data.substr(0, 5) == "PEER ")
+        {
+            bool first_message;
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                first_message = client_states.find(client_sock) == client_states.end();
+            }
+            if (first_message)
+            {
+                std::string hello = data.substr(5, find_byte(data, '\n') - 5);
+                std::string secret = hello.find(' ') == std::string::npos ? "" : hello.substr(hello.find(' ') + 1);
+                if (!peerSecretMatches(secret, peer_secret))
+                {
+                    log_error("拒绝未授权的对等链路 (" + client_ip + ")");
+                    return false;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(peers_mutex);
+                    peers[client_sock];
+                }
+                send_data(client_sock, peer_hello() + presence_snapshot());
+                return handle_peer_data(client_sock, data);
+            }
+        }
+
         // 当新客户端连接时，初始化其状态
         {
             std::lock_guard<std::mutex> lock(clients_mutex);
@@ -81,24 +1833,44 @@ public:
         if (data.substr(0, 9) == "NICKNAME ")
         {
             std::string nickname = trim(data.substr(9));
+            if (!isValidNickname(nickname))
+            {
+                send_data(client_sock, "系统消息: 昵称不能为空，也不能包含控制字符");
+                return true;
+            }
+            // 取出离线消息与加入在线列表在同一把锁内完成，期间的广播不会两头落空；
+            // 离线消息也在锁内发出，保证先于之后的广播到达
             {
                 std::lock_guard<std::mutex> lock(clients_mutex);
+                std::vector<std::string> backlog = take_offline(nickname);
                 clients.insert(client_sock);
                 client_nicknames[client_sock] = nickname;
                 client_states[client_sock] = ClientState::NICKNAME_SET;
+                send_data(client_sock, "昵称已设置为: " + nickname);
+                if (!backlog.empty())
+                {
+                    send_batch(client_sock, backlog);
+                }
             }
 
+            std::string token;
+            bool was_suspended = issue_token(nickname, token);
+
             log_info("用户 " + nickname + " 加入聊天");
-            // 广播消息
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            for (SOCKET client : clients)
+            // 断线宽限期内重新登录的，离开通知还没发，不用再通知加入
+            if (!was_suspended)
             {
-                if (client != client_sock)
-                {
-                    send_data(client, "系统消息: " + nickname + " 加入了聊天");
-                }
+                broadcast_local(client_sock, "系统消息: " + nickname + " 加入了聊天");
+                send_to_peers("JOIN " + nickname);
             }
-            send_data(client_sock, "昵称已设置为: " + nickname);
+            send_data(client_sock, "SESSION " + token);
+            return true;
+        }
+
+        // 断线重连：凭会话令牌恢复
+        if (data.substr(0, 7) == "RESUME ")
+        {
+            handle_resume(client_sock, client_ip, trim(data.substr(7)));
             return true;
         }
 
@@ -106,23 +1878,25 @@ public:
         if (data == "exit")
         {
             std::string nickname = getNickname(client_sock, client_ip);
+            log_info("用户 " + nickname + " 离开聊天");
+            // 先广播离开通知（不发给自己），再在同一把锁内移出在线列表并开始保存离线消息
+            broadcast_local(client_sock, "系统消息: " + nickname + " 离开了聊天");
+            send_to_peers("LEAVE " + nickname);
+            bool was_member = false;
             {
                 std::lock_guard<std::mutex> lock(clients_mutex);
-                clients.erase(client_sock);
+                was_member = clients.erase(client_sock) > 0;
                 client_nicknames.erase(client_sock);
                 client_states[client_sock] = ClientState::DISCONNECTED;
-            }
-
-            log_info("用户 " + nickname + " 离开聊天");
-            // 广播消息
-            std::lock_guard<std::mutex> lock(clients_mutex);
-            for (SOCKET client : clients)
-            {
-                if (client != client_sock)
+                if (was_member)
                 {
-                    send_data(client, "系统消息: " + nickname + " 离开了聊天");
+                    offline.set_offline(nickname);
                 }
             }
+            if (was_member)
+            {
+                revoke_token(nickname);
+            }
             return false;
         }
 
@@ -136,19 +1910,31 @@ public:
             }
         }
 
+        // 分享文件与下载共享文件
+        if (data.substr(0, 6) == "SHARE ")
+        {
+            handle_share(client_sock, client_ip, data.substr(6));
+            return true;
+        }
+        if (data.substr(0, 4) == "GET ")
+        {
+            handle_get(client_sock, trim(data.substr(4)));
+            return true;
+        }
+        if (data.substr(0, 7) == "SEARCH ")
+        {
+            handle_search(client_sock, data.substr(7));
+            return true;
+        }
+
         // 处理普通消息
         std::string nickname = getNickname(client_sock, client_ip);
         std::string message = "[" + nickname + "]: " + data;
         log_debug("转发消息: " + message);
+        search_index.add(nickname, data);
         // 广播消息
-        std::lock_guard<std::mutex> lock(clients_mutex);
-        for (SOCKET client : clients)
-        {
-            if (client != client_sock)
-            {
-                send_data(client, message);
-            }
-        }
+        broadcast_local(client_sock, message);
+        send_to_peers("MSG " + message);
 
         return true;
     }
@@ -156,22 +1942,61 @@ public:
 
 ChatTCPServer *server = nullptr; // 服务器实例
 
-int main()
+int main(int argc, char *argv[])
 {
+    // 命令行参数：
+    //   --port 端口        监听端口（默认8888）
+    //   --peer IP:端口     连接到另一台聊天服务器组成同一个聊天室（可重复）
+    //   --peer-secret 密钥 对等服务器之间的共享密钥，组成聊天室的每台服务器都要指定
+    //   --local 路径       额外监听本机AF_UNIX套接字，供同机的机器人和桥接程序使用
+    //   --takeover         从正在运行的旧进程接管监听端口和全部连接
+    int port = 8888;
+    bool takeover = false;
+    std::vector<std::string> peer_addrs;
+    std::string peer_secret;
+    std::string local_path;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--takeover")
+            takeover = true;
+        else if (arg == "--port" && i + 1 < argc)
+            port = std::atoi(argv[++i]);
+        else if (arg == "--peer" && i + 1 < argc)
+            peer_addrs.push_back(argv[++i]);
+        else if (arg == "--peer-secret" && i + 1 < argc)
+            peer_secret = argv[++i];
+        else if (arg == "--local" && i + 1 < argc)
+            local_path = argv[++i];
+    }
+
     setConsoleUTF8();
     ConsoleColor::set(ConsoleColor::YELLOW);
     std::cout << "=== 多人聊天服务器 ===" << std::endl;
     ConsoleColor::set(ConsoleColor::WHITE);
 
+    if (!peer_addrs.empty() && peer_secret.empty())
+    {
+        std::cerr << "使用 --peer 时必须同时指定 --peer-secret" << std::endl;
+        return 1;
+    }
+
     // 创建并启动服务器
-    server = new ChatTCPServer("0.0.0.0", 8888);
+    server = new ChatTCPServer("0.0.0.0", port);
+    server->set_peer_secret(peer_secret);
 
-    if (!server->init())
+    if (!(takeover ? server->takeover() : server->init()))
     {
         std::cerr << "服务器初始化失败" << std::endl;
         delete server;
         return 1;
     }
+    server->load_offline();
+
+    if (!local_path.empty() && !server->listen_local(local_path))
+    {
+        std::cerr << "本机套接字监听失败，仅提供TCP连接" << std::endl;
+    }
 
     if (!server->start())
     {
@@ -180,14 +2005,20 @@ int main()
         return 1;
     }
 
+    for (const std::string &addr : peer_addrs)
+    {
+        server->add_peer(addr);
+    }
+
     std::cout << "服务器运行中，按Ctrl+C退出..." << std::endl;
 
-    // 保持服务器运行
-    while (true)
+    // 保持服务器运行，直到连接被新进程接管
+    while (!server->is_handed_off())
     {
         std::this_thread::sleep_for(std::chrono::seconds(1));
     }
 
+    std::cout << "连接已交给新进程，旧进程退出" << std::endl;
     delete server;
     return 0;
-}
\ No newline at end of file
+}
@@ -1,11 +1,25 @@
 #ifndef SOCK_HPP
 #define SOCK_HPP
 
+// Winsock 的 select 默认只能等待64个套接字，ClientEngine 需要在一个线程里管理更多会话
+#ifndef FD_SETSIZE
+#define FD_SETSIZE 1024
+#endif
+
 #include <bits/stdc++.h>
 #include <winsock2.h>
+#include <afunix.h>
 #include <windows.h>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // 仅在MSVC编译器下使用#pragma comment
 #ifdef _MSC_VER
@@ -23,6 +37,47 @@ inline void setConsoleUTF8()
 // 缓冲区大小可配置
 const int DEFAULT_BUFFER_SIZE = 1048576; // 1MB
 
+// 连接接入参数
+const int DEFAULT_MAX_CONNECTIONS = 1024; // 同时在线连接上限，超出后拒绝新连接
+const int ACCEPT_BATCH_SIZE = 64;         // 每轮从积压队列中最多取出的连接数
+const int ACCEPT_STATS_INTERVAL = 5;      // 接入速率统计周期（秒）
+const char SERVER_BUSY_FRAME[] = "SERVER_BUSY 服务器繁忙，请稍后重试\n";
+
+// 热重启交接参数（新旧进程通过命名管道传递套接字）
+const char HANDOFF_PIPE_PREFIX[] = "\\\\.\\pipe\\sock-chater-handoff-";
+const DWORD HANDOFF_CONNECT_TIMEOUT = 5000; // 等待旧进程交接管道的超时（毫秒）
+const int HANDOFF_DRAIN_TIMEOUT = 2000;     // 交接后等待旧处理线程退出的超时（毫秒）
+const uint32_t HANDOFF_END = 0;             // 交接记录类型：结束
+const uint32_t HANDOFF_LISTENER = 1;        // 交接记录类型：监听套接字
+const uint32_t HANDOFF_SESSION = 2;         // 交接记录类型：客户端连接
+const uint32_t HANDOFF_LOCAL_LISTENER = 3;  // 交接记录类型：本机（AF_UNIX）监听套接字
+
+// 服务端单次 send 最长阻塞时间（毫秒）：对端长时间不读时视为连接失效，避免发送线程和交接被卡住
+const DWORD SEND_TIMEOUT = 10000;
+
+// 客户端上传文件的默认保存目录
+const char DEFAULT_UPLOAD_DIR[] = "uploads";
+
+// 本机连接的客户端地址标识
+const char LOCAL_CLIENT_IP[] = "local";
+
+// 客户端断线重连的退避时间（毫秒）：从最小值起每次翻倍，不超过最大值
+const int RECONNECT_MIN_MS = 500;
+const int RECONNECT_MAX_MS = 30000;
+
+// 事件驱动客户端单个会话允许积压的待发送字节数
+const size_t ENGINE_MAX_PENDING = 4 * 1024 * 1024;
+// 已发出的部分超过此大小且占到缓冲区一半时，从发送缓冲区中移除
+const size_t ENGINE_COMPACT_BYTES = 64 * 1024;
+
+// 连接接入统计
+struct AcceptStats
+{
+    unsigned long long accepted; // 累计接入连接数
+    unsigned long long rejected; // 累计因超出上限被拒绝的连接数
+    int active;                  // 当前活跃连接数
+};
+
 // 控制台颜色控制
 namespace ConsoleColor
 {
@@ -38,55 +93,1567 @@ namespace ConsoleColor
     const int YELLOW = 6;
 }
 
-// 服务端类
-class TCPServer
-{
-private:
-    std::string ip;
-    int port;
-    SOCKET server_socket;
-    bool is_running;
-    int buffer_size;
-    std::mutex console_mutex; // 控制台输出互斥锁
+// 取路径中的文件名部分
+inline std::string file_basename(const std::string &path)
+{
+    size_t pos = path.find_last_of("/\\");
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+// 接收路径上的文本扫描：UTF-8校验、空白裁剪、分隔符查找
+// 按编译目标选用AVX2/SSSE3/SSE2向量实现，其余平台使用逐字节实现，结果一致
+
+// ASCII空白字符（空格、\t \n \v \f \r），不依赖区域设置，对非ASCII字节恒为false
+inline bool is_ascii_space(unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+#if defined(__SSE2__)
+// 16字节中空白字符的位掩码
+inline unsigned space_mask16(__m128i block)
+{
+    __m128i space = _mm_cmpeq_epi8(block, _mm_set1_epi8(' '));
+    __m128i ctrl = _mm_sub_epi8(block, _mm_set1_epi8('\t'));
+    ctrl = _mm_cmpeq_epi8(_mm_min_epu8(ctrl, _mm_set1_epi8(4)), ctrl); // ctrl - '\t' <= 4
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(space, ctrl));
+}
+#endif
+
+// 查找字节 c 第一次出现的位置，找不到返回 size
+inline size_t find_byte(const char *data, size_t size, char c)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    __m256i needle32 = _mm256_set1_epi8(c);
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle32));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i needle16 = _mm_set1_epi8(c);
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle16));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < size; ++i)
+    {
+        if (data[i] == c)
+            return i;
+    }
+    return size;
+}
+
+inline size_t find_byte(const std::string &str, char c, size_t from = 0)
+{
+    if (from >= str.size())
+        return std::string::npos;
+    size_t pos = from + find_byte(str.data() + from, str.size() - from, c);
+    return pos == str.size() ? std::string::npos : pos;
+}
+
+// 去掉首尾的ASCII空白，[begin, end) 为剩余部分
+inline void trim_span(const char *data, size_t size, size_t &begin, size_t &end)
+{
+    begin = 0;
+    end = size;
+#if defined(__SSE2__)
+    for (; begin + 16 <= end; begin += 16)
+    {
+        unsigned mask = space_mask16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + begin)));
+        if (mask != 0xffff)
+        {
+            begin += __builtin_ctz(~mask);
+            break;
+        }
+    }
+#endif
+    while (begin < end && is_ascii_space((unsigned char)data[begin]))
+        ++begin;
+#if defined(__SSE2__)
+    for (; end >= begin + 16; end -= 16)
+    {
+        unsigned mask = space_mask16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + end - 16)));
+        if (mask != 0xffff)
+        {
+            end = end - 16 + (31 - __builtin_clz(~mask & 0xffff)) + 1;
+            break;
+        }
+    }
+#endif
+    while (end > begin && is_ascii_space((unsigned char)data[end - 1]))
+        --end;
+}
+
+// 逐字节校验UTF-8：拒绝截断、多余的后续字节、过长编码、代理项和超过U+10FFFF的码点
+inline bool utf8_valid_scalar(const unsigned char *data, size_t size)
+{
+    size_t i = 0;
+    while (i < size)
+    {
+        unsigned char c = data[i];
+        if (c < 0x80)
+        {
+            ++i;
+            continue;
+        }
+
+        size_t len;
+        unsigned char lo = 0x80, hi = 0xbf; // 第二个字节的合法范围
+        if (c >= 0xc2 && c <= 0xdf)
+            len = 2;
+        else if (c >= 0xe0 && c <= 0xef)
+        {
+            len = 3;
+            if (c == 0xe0)
+                lo = 0xa0; // 过长编码
+            else if (c == 0xed)
+                hi = 0x9f; // 代理项
+        }
+        else if (c >= 0xf0 && c <= 0xf4)
+        {
+            len = 4;
+            if (c == 0xf0)
+                lo = 0x90; // 过长编码
+            else if (c == 0xf4)
+                hi = 0x8f; // 超过U+10FFFF
+        }
+        else
+            return false;
+
+        if (i + len > size || data[i + 1] < lo || data[i + 1] > hi)
+            return false;
+        for (size_t k = 2; k < len; ++k)
+        {
+            if ((data[i + k] & 0xc0) != 0x80)
+                return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+#if defined(__SSSE3__)
+// 查表法UTF-8校验：每16字节用前一块末尾的3个字节拼出每个字节之前的上下文，
+// 按(前一字节高4位, 前一字节低4位, 当前字节高4位)三张表取出可能的错误位，三者相与不为0即非法
+class Utf8Checker
+{
+private:
+    enum : uint8_t
+    {
+        TOO_SHORT = 1 << 0,      // 前导字节后缺少后续字节
+        TOO_LONG = 1 << 1,       // ASCII后出现后续字节
+        OVERLONG_3 = 1 << 2,     // 3字节过长编码
+        TOO_LARGE = 1 << 3,      // 超过U+10FFFF
+        SURROGATE = 1 << 4,      // 代理项 U+D800..U+DFFF
+        OVERLONG_2 = 1 << 5,     // 2字节过长编码
+        TOO_LARGE_1000 = 1 << 6, // F5及以上的前导字节
+        OVERLONG_4 = 1 << 6,     // 4字节过长编码
+        TWO_CONTS = 1 << 7,      // 两个后续字节相连（需结合更前面的字节判断）
+        CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS
+    };
+
+    __m128i error = _mm_setzero_si128();
+    __m128i prev_input = _mm_setzero_si128();
+    __m128i prev_incomplete = _mm_setzero_si128(); // 上一块末尾未结束的多字节序列
+
+    static __m128i high_nibbles(__m128i v)
+    {
+        return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0f));
+    }
+
+    void check_block(__m128i input)
+    {
+        const __m128i byte_1_high_table = _mm_setr_epi8(
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+            TOO_SHORT | OVERLONG_2,
+            TOO_SHORT,
+            TOO_SHORT | OVERLONG_3 | SURROGATE,
+            TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+        const __m128i byte_1_low_table = _mm_setr_epi8(
+            CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+            CARRY | OVERLONG_2,
+            CARRY,
+            CARRY,
+            CARRY | TOO_LARGE,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+            CARRY | TOO_LARGE | TOO_LARGE_1000,
+            CARRY | TOO_LARGE | TOO_LARGE_1000);
+        const __m128i byte_2_high_table = _mm_setr_epi8(
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+            TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+
+        // 单字节规则
+        __m128i prev1 = _mm_alignr_epi8(input, prev_input, 15);
+        __m128i special = _mm_and_si128(
+            _mm_and_si128(_mm_shuffle_epi8(byte_1_high_table, high_nibbles(prev1)),
+                          _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, _mm_set1_epi8(0x0f)))),
+            _mm_shuffle_epi8(byte_2_high_table, high_nibbles(input)));
+
+        // 3、4字节序列中第三、四个字节必须是后续字节
+        __m128i prev2 = _mm_alignr_epi8(input, prev_input, 14);
+        __m128i prev3 = _mm_alignr_epi8(input, prev_input, 13);
+        __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xe0 - 1)));
+        __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 1)));
+        __m128i must23 = _mm_cmpgt_epi8(_mm_or_si128(third, fourth), _mm_setzero_si128());
+        __m128i must23_80 = _mm_and_si128(must23, _mm_set1_epi8((char)0x80));
+        error = _mm_or_si128(error, _mm_xor_si128(must23_80, special));
+    }
+
+public:
+    void update(__m128i input)
+    {
+        if (_mm_movemask_epi8(input) == 0)
+        {
+            // 纯ASCII块：只需确认上一块没有未结束的序列
+            error = _mm_or_si128(error, prev_incomplete);
+            prev_incomplete = _mm_setzero_si128();
+        }
+        else
+        {
+            check_block(input);
+            const __m128i max_value = _mm_setr_epi8(
+                -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1));
+            prev_incomplete = _mm_subs_epu8(input, max_value);
+        }
+        prev_input = input;
+    }
+
+    bool finish()
+    {
+        error = _mm_or_si128(error, prev_incomplete);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xffff;
+    }
+};
+#endif
+
+// 校验UTF-8编码是否合法（严格模式，与 utf8_valid_scalar 的判定一致）
+inline bool utf8_valid(const char *data, size_t size)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    // 先用32字节一块跳过纯ASCII的开头
+    for (; i + 32 <= size; i += 32)
+    {
+        if (_mm256_movemask_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i))) != 0)
+            break;
+    }
+#endif
+#if defined(__SSSE3__)
+    Utf8Checker checker;
+    for (; i + 16 <= size; i += 16)
+    {
+        checker.update(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)));
+    }
+    if (i < size)
+    {
+        // 不足16字节的尾部补0（ASCII）后再校验
+        char tail[16] = {};
+        memcpy(tail, data + i, size - i);
+        checker.update(_mm_loadu_si128(reinterpret_cast<const __m128i *>(tail)));
+    }
+    return checker.finish();
+#else
+#if defined(__SSE2__)
+    // 跳过纯ASCII块，从第一个非ASCII字节所在序列的开头开始逐字节校验
+    for (; i + 16 <= size; i += 16)
+    {
+        if (_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i))) != 0)
+            break;
+    }
+#endif
+    return utf8_valid_scalar(reinterpret_cast<const unsigned char *>(data) + i, size - i);
+#endif
+}
+
+inline bool utf8_valid(const std::string &str)
+{
+    return utf8_valid(str.data(), str.size());
+}
+
+// 帧格式：类型(1字节) + 流编号(4字节) + 负载长度(4字节) + 负载，整数均为网络字节序
+// 聊天消息和文件数据共用一条连接，文件被切成数据块与聊天消息交错发送
+const uint8_t FRAME_MESSAGE = 1;      // 聊天/控制消息（流编号为0）
+const uint8_t FRAME_STREAM_OPEN = 2;  // 打开文件流，负载为 "大小:文件名"
+const uint8_t FRAME_STREAM_DATA = 3;  // 文件数据块
+const uint8_t FRAME_STREAM_END = 4;   // 文件流正常结束
+const uint8_t FRAME_STREAM_ABORT = 5; // 文件流中止
+const size_t FRAME_HEADER_SIZE = 9;
+const uint32_t FRAME_MAX_PAYLOAD = 16 * 1024 * 1024; // 超过此长度视为协议错误
+const size_t STREAM_CHUNK_SIZE = 65536;              // 文件数据块大小，决定聊天消息最多等待的字节数
+const int STREAM_DEFAULT_PRIORITY = 1;               // 流优先级：每轮调度连续发送的数据块数
+const int STREAM_MAX_PRIORITY = 8;
+const size_t SENDER_MAX_QUEUED = 4 * 1024 * 1024;                 // 单个连接排队待发的消息字节数上限，超出后丢弃新消息
+const size_t STREAM_MAX_OPEN = 4;                                  // 单个连接同时接收的文件流上限
+const long long DEFAULT_UPLOAD_LIMIT = 4LL * 1024 * 1024 * 1024; // 单个连接累计可上传的字节数
+
+// 一个完整的帧
+struct Frame
+{
+    uint8_t type;
+    uint32_t stream;
+    std::string payload;
+};
+
+// 编码一个帧
+inline std::string encode_frame(uint8_t type, uint32_t stream, const char *data, size_t size)
+{
+    std::string frame(FRAME_HEADER_SIZE + size, '\0');
+    uint32_t stream_be = htonl(stream);
+    uint32_t size_be = htonl((u_long)size);
+    frame[0] = (char)type;
+    memcpy(&frame[1], &stream_be, 4);
+    memcpy(&frame[5], &size_be, 4);
+    if (size > 0)
+        memcpy(&frame[FRAME_HEADER_SIZE], data, size);
+    return frame;
+}
+
+inline std::string encode_frame(uint8_t type, uint32_t stream, const std::string &payload)
+{
+    return encode_frame(type, stream, payload.data(), payload.size());
+}
+
+// 接收端的帧拆分：recv得到的字节流可能包含半个或多个帧
+class FrameReader
+{
+private:
+    std::string buffer;
+    size_t offset;
+
+public:
+    FrameReader() : offset(0) {}
+
+    void append(const char *data, size_t size)
+    {
+        // 已消费的部分较多时整理缓冲区，避免无限增长
+        if (offset > 0 && offset >= buffer.size() / 2)
+        {
+            buffer.erase(0, offset);
+            offset = 0;
+        }
+        buffer.append(data, size);
+    }
+
+    // 取出下一个完整的帧；数据不足返回false，协议错误时设置error
+    bool next(Frame &frame, bool &error)
+    {
+        error = false;
+        if (buffer.size() - offset < FRAME_HEADER_SIZE)
+            return false;
+
+        const char *header = buffer.data() + offset;
+        uint32_t stream_be, size_be;
+        memcpy(&stream_be, header + 1, 4);
+        memcpy(&size_be, header + 5, 4);
+        uint32_t size = ntohl(size_be);
+        if (header[0] < FRAME_MESSAGE || header[0] > FRAME_STREAM_ABORT || size > FRAME_MAX_PAYLOAD)
+        {
+            error = true;
+            return false;
+        }
+        if (buffer.size() - offset < FRAME_HEADER_SIZE + size)
+            return false;
+
+        frame.type = (uint8_t)header[0];
+        frame.stream = ntohl(stream_be);
+        frame.payload.assign(header + FRAME_HEADER_SIZE, size);
+        offset += FRAME_HEADER_SIZE + size;
+        return true;
+    }
+
+    // 尚未凑成完整帧的字节（热重启时交给新进程）
+    std::string pending() const
+    {
+        return buffer.substr(offset);
+    }
+};
+
+// SHA-256 摘要（用于按内容寻址的共享文件）
+class Sha256
+{
+private:
+    uint32_t state[8];
+    unsigned char block[64];
+    size_t block_len;
+    uint64_t total_len;
+
+    static uint32_t rotr(uint32_t x, int n)
+    {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void transform(const unsigned char *data)
+    {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 | (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        for (int i = 16; i < 64; ++i)
+        {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+public:
+    Sha256() : block_len(0), total_len(0)
+    {
+        static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(state, init, sizeof(state));
+    }
+
+    void update(const char *data, size_t size)
+    {
+        const unsigned char *ptr = reinterpret_cast<const unsigned char *>(data);
+        total_len += size;
+        while (size > 0)
+        {
+            if (block_len == 0 && size >= 64)
+            {
+                transform(ptr);
+                ptr += 64;
+                size -= 64;
+                continue;
+            }
+            size_t take = std::min(size, 64 - block_len);
+            memcpy(block + block_len, ptr, take);
+            block_len += take;
+            ptr += take;
+            size -= take;
+            if (block_len == 64)
+            {
+                transform(block);
+                block_len = 0;
+            }
+        }
+    }
+
+    // 结束计算，返回64位小写十六进制摘要
+    std::string hex_digest()
+    {
+        uint64_t bit_len = total_len * 8;
+        unsigned char pad = 0x80;
+        update(reinterpret_cast<const char *>(&pad), 1);
+        unsigned char zero = 0;
+        while (block_len != 56)
+            update(reinterpret_cast<const char *>(&zero), 1);
+        unsigned char len_be[8];
+        for (int i = 0; i < 8; ++i)
+            len_be[i] = (unsigned char)(bit_len >> (56 - i * 8));
+        update(reinterpret_cast<const char *>(len_be), 8);
+
+        static const char hex[] = "0123456789abcdef";
+        std::string digest;
+        for (int i = 0; i < 8; ++i)
+        {
+            for (int shift = 28; shift >= 0; shift -= 4)
+                digest += hex[(state[i] >> shift) & 0xf];
+        }
+        return digest;
+    }
+};
+
+// 计算文件的SHA-256，同时返回文件大小
+inline bool sha256_file(const std::string &path, std::string &digest, long long &size)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    Sha256 sha;
+    std::vector<char> buffer(STREAM_CHUNK_SIZE);
+    size = 0;
+    while (file)
+    {
+        std::streamsize bytes_read = file.read(buffer.data(), buffer.size()).gcount();
+        if (bytes_read <= 0)
+            break;
+        sha.update(buffer.data(), bytes_read);
+        size += bytes_read;
+    }
+    digest = sha.hex_digest();
+    return true;
+}
+
+// 内容哈希格式检查（64位小写十六进制），同时防止哈希被当作路径使用
+inline bool is_content_hash(const std::string &hash)
+{
+    if (hash.size() != 64)
+        return false;
+    for (char c : hash)
+    {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+            return false;
+    }
+    return true;
+}
+
+// 只读内存映射文件，多个下载共享同一份映射（走系统页缓存，不重复读盘）
+class MappedFile
+{
+private:
+    HANDLE file;
+    HANDLE mapping;
+    const char *view;
+    size_t length;
+
+    MappedFile() : file(INVALID_HANDLE_VALUE), mapping(NULL), view(nullptr), length(0) {}
+
+public:
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (view)
+            UnmapViewOfFile(view);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+    }
+
+    // 打开并映射文件，失败返回空指针（空文件不映射，长度为0）
+    static std::shared_ptr<MappedFile> open(const std::string &path)
+    {
+        std::shared_ptr<MappedFile> mapped(new MappedFile());
+        mapped->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (mapped->file == INVALID_HANDLE_VALUE)
+            return nullptr;
+
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(mapped->file, &file_size))
+            return nullptr;
+        mapped->length = (size_t)file_size.QuadPart;
+        if (mapped->length == 0)
+            return mapped;
+
+        mapped->mapping = CreateFileMappingA(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapped->mapping)
+            return nullptr;
+        mapped->view = static_cast<const char *>(MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!mapped->view)
+            return nullptr;
+        return mapped;
+    }
+
+    const char *data() const
+    {
+        return view;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+};
+
+// 发送端调度：聊天消息优先，文件流按优先级加权轮转，每次只发一个数据块
+// 没有文件流时消息直接发送，不额外占用线程；有文件流时才启动发送线程，队列发空后线程退出
+class FrameSender
+{
+private:
+    struct OutStream
+    {
+        uint32_t id;
+        std::ifstream file;
+        std::shared_ptr<const MappedFile> mapped; // 非空时直接从共享映射发送，不读盘
+        size_t offset;
+        int priority;
+        int credit; // 本轮剩余可发送的数据块数
+    };
+
+    SOCKET sock;
+    std::mutex mutex;
+    std::deque<std::string> messages;
+    size_t queued_bytes; // messages 中的字节数
+    std::deque<std::shared_ptr<OutStream>> streams;
+    std::thread worker;
+    bool worker_done; // 发送线程已空闲退出，等待回收
+    bool stopping;
+    bool failed;
+    uint32_t next_stream_id;
+
+    // 回收已空闲退出的发送线程（调用者持有锁；线程设置标志后不再取锁，可安全等待）
+    void reap_worker()
+    {
+        if (worker.joinable() && worker_done)
+        {
+            worker.join();
+            worker_done = false;
+        }
+    }
+
+    // 有发送线程时排队，否则直接发送（调用者持有锁）
+    bool post(std::string frames)
+    {
+        if (stopping || failed)
+            return false;
+        reap_worker();
+        if (!worker.joinable())
+        {
+            failed = !write_all(frames);
+            return !failed;
+        }
+        if (queued_bytes + frames.size() > SENDER_MAX_QUEUED)
+            return false; // 对端读得太慢，丢弃而不是无限占用内存
+        queued_bytes += frames.size();
+        messages.push_back(std::move(frames));
+        return true;
+    }
+
+    bool enqueue_stream(std::shared_ptr<OutStream> stream, long long size, const std::string &name, int priority)
+    {
+        stream->offset = 0;
+        stream->priority = std::max(1, std::min(priority, STREAM_MAX_PRIORITY));
+        stream->credit = stream->priority;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stopping || failed)
+            return false;
+        reap_worker();
+        stream->id = next_stream_id++;
+        std::string open_frame = encode_frame(FRAME_STREAM_OPEN, stream->id, std::to_string(size) + ":" + name);
+        queued_bytes += open_frame.size();
+        messages.push_back(std::move(open_frame));
+        streams.push_back(stream);
+        if (!worker.joinable())
+            worker = std::thread(&FrameSender::run, this);
+        return true;
+    }
+
+    bool write_all(const std::string &data)
+    {
+        size_t sent = 0;
+        while (sent < data.size())
+        {
+            int ret = send(sock, data.data() + sent, (int)(data.size() - sent), 0);
+            if (ret == SOCKET_ERROR)
+                return false;
+            sent += ret;
+        }
+        return true;
+    }
+
+    void run()
+    {
+        std::vector<char> chunk(STREAM_CHUNK_SIZE);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!failed)
+        {
+            // 队列发空后退出，之后的消息由调用线程直接发送
+            if (!stopping && messages.empty() && streams.empty())
+                break;
+
+            // 停止时发完已排队的消息，并通知对端未完成的文件流已中止（发送时不持锁）
+            if (stopping)
+            {
+                std::string frames;
+                for (std::string &message : messages)
+                    frames += message;
+                for (auto &stream : streams)
+                    frames += encode_frame(FRAME_STREAM_ABORT, stream->id, "", 0);
+                messages.clear();
+                streams.clear();
+                queued_bytes = 0;
+                lock.unlock();
+                bool ok = write_all(frames);
+                lock.lock();
+                failed = failed || !ok;
+                break;
+            }
+
+            // 聊天消息总是先于下一个数据块发送
+            std::string frame;
+            if (!messages.empty())
+            {
+                frame = std::move(messages.front());
+                messages.pop_front();
+                queued_bytes -= frame.size();
+            }
+            else
+            {
+                // 读盘时不持锁，只有发送线程会访问队首的文件流
+                std::shared_ptr<OutStream> stream = streams.front();
+                lock.unlock();
+                bool finished;
+                if (stream->mapped)
+                {
+                    size_t bytes = std::min(STREAM_CHUNK_SIZE, stream->mapped->size() - stream->offset);
+                    if (bytes > 0)
+                        frame = encode_frame(FRAME_STREAM_DATA, stream->id, stream->mapped->data() + stream->offset, bytes);
+                    stream->offset += bytes;
+                    finished = stream->offset >= stream->mapped->size();
+                }
+                else
+                {
+                    std::streamsize bytes_read = stream->file.read(chunk.data(), chunk.size()).gcount();
+                    finished = stream->file.eof() || bytes_read <= 0;
+                    if (bytes_read > 0)
+                        frame = encode_frame(FRAME_STREAM_DATA, stream->id, chunk.data(), bytes_read);
+                }
+                if (finished)
+                    frame += encode_frame(FRAME_STREAM_END, stream->id, "", 0);
+                lock.lock();
+
+                if (finished)
+                {
+                    streams.pop_front();
+                }
+                else if (--stream->credit <= 0)
+                {
+                    stream->credit = stream->priority;
+                    streams.pop_front();
+                    streams.push_back(stream);
+                }
+            }
+
+            lock.unlock();
+            bool ok = write_all(frame);
+            lock.lock();
+            if (!ok)
+            {
+                failed = true;
+                streams.clear();
+                messages.clear();
+                queued_bytes = 0;
+            }
+        }
+        worker_done = true;
+    }
+
+public:
+    explicit FrameSender(SOCKET sock)
+        : sock(sock), queued_bytes(0), worker_done(false), stopping(false), failed(false), next_stream_id(1) {}
+
+    ~FrameSender()
+    {
+        close();
+    }
+
+    // 发送一条消息；有文件流在传输时排队，由发送线程插在数据块之间发出
+    // 排队的消息超过 SENDER_MAX_QUEUED 时返回false
+    bool send_message(const std::string &payload)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return post(encode_frame(FRAME_MESSAGE, 0, payload));
+    }
+
+    // 一次写出多个已编码的帧（合并为一次send）
+    bool send_raw(const std::string &frames)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return post(frames);
+    }
+
+    // 开始发送一个文件流，立即返回；文件名为对端看到的名称
+    bool send_stream(const std::string &file_path, const std::string &name, int priority = STREAM_DEFAULT_PRIORITY)
+    {
+        auto stream = std::make_shared<OutStream>();
+        stream->file.open(file_path, std::ios::binary | std::ios::ate);
+        if (!stream->file.is_open())
+            return false;
+        std::streamsize file_size = stream->file.tellg();
+        stream->file.seekg(0, std::ios::beg);
+        return enqueue_stream(stream, file_size, name, priority);
+    }
+
+    // 从共享的内存映射发送一个文件流（多个连接可同时发送同一映射）
+    bool send_stream(std::shared_ptr<const MappedFile> mapped, const std::string &name, int priority = STREAM_DEFAULT_PRIORITY)
+    {
+        auto stream = std::make_shared<OutStream>();
+        stream->mapped = mapped;
+        return enqueue_stream(stream, (long long)mapped->size(), name, priority);
+    }
+
+    // 通知发送线程停止，不等待（用于同时停止多个连接）
+    // flush 为false时丢弃排队的消息和文件流（对端已断开），发送线程发完当前帧即退出
+    void begin_close(bool flush = true)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        if (!flush)
+        {
+            messages.clear();
+            streams.clear();
+            queued_bytes = 0;
+        }
+    }
+
+    // 停止发送：发完排队中的消息，中止未完成的文件流，然后等待发送线程退出
+    // 返回false表示有数据没能完整发出（对端已断开或发送超时），此时帧边界可能已被破坏
+    bool close(bool flush = true)
+    {
+        begin_close(flush);
+        if (worker.joinable() && worker.get_id() != std::this_thread::get_id())
+            worker.join();
+        std::lock_guard<std::mutex> lock(mutex);
+        return !failed;
+    }
+};
+
+// 接收端的文件流落盘
+class StreamFileSink
+{
+private:
+    struct InFile
+    {
+        std::ofstream file;
+        std::string path;
+        long long expected;
+        long long received;
+    };
+
+    std::string dir;
+    std::map<uint32_t, InFile> files;
+    long long budget; // 剩余可接收的字节数（已声明的文件流预先占用），负数表示不限
+
+    // 只保留文件名部分，防止对端通过路径写到保存目录之外
+    static std::string safe_name(const std::string &name)
+    {
+        size_t pos = name.find_last_of("/\\:");
+        std::string base = pos == std::string::npos ? name : name.substr(pos + 1);
+        if (base.empty() || base == "." || base == "..")
+            return "unnamed";
+        return base;
+    }
+
+public:
+    explicit StreamFileSink(const std::string &dir = ".") : dir(dir), budget(-1) {}
+
+    void set_dir(const std::string &save_dir)
+    {
+        dir = save_dir;
+    }
+
+    // 限制累计接收的字节数（负数表示不限）
+    void set_limit(long long bytes)
+    {
+        budget = bytes;
+    }
+
+    // 打开文件流（负载格式：大小:文件名，文件名须为合法UTF-8），失败返回false
+    // 同时打开的流不超过 STREAM_MAX_OPEN，声明的大小须在剩余额度内
+    bool open(uint32_t stream, const std::string &header)
+    {
+        size_t pos = find_byte(header, ':');
+        if (pos == std::string::npos || !utf8_valid(header.data() + pos + 1, header.size() - pos - 1))
+            return false;
+        long long expected = std::atoll(header.substr(0, pos).c_str());
+        if (expected < 0 || (budget >= 0 && expected > budget) || files.size() >= STREAM_MAX_OPEN ||
+            files.count(stream) > 0)
+            return false;
+
+        InFile &in = files[stream];
+        in.expected = expected;
+        in.received = 0;
+        in.path = dir + "\\" + safe_name(header.substr(pos + 1));
+        in.file.open(in.path, std::ios::binary);
+        if (!in.file.is_open())
+        {
+            files.erase(stream);
+            return false;
+        }
+        if (budget >= 0)
+            budget -= expected;
+        return true;
+    }
+
+    // 写入数据块；未知的流直接忽略，超出声明大小时中止该流并返回false
+    bool write(uint32_t stream, const std::string &data)
+    {
+        auto it = files.find(stream);
+        if (it == files.end())
+            return true;
+        if (it->second.received + (long long)data.size() > it->second.expected)
+        {
+            abort(stream);
+            return false;
+        }
+        it->second.file.write(data.data(), data.size());
+        it->second.received += data.size();
+        return true;
+    }
+
+    // 正在接收的文件名
+    std::vector<std::string> open_names() const
+    {
+        std::vector<std::string> names;
+        for (auto &entry : files)
+            names.push_back(entry.second.path.substr(entry.second.path.find_last_of('\\') + 1));
+        return names;
+    }
+
+    // 结束文件流；大小与声明一致时返回true并给出保存路径
+    bool finish(uint32_t stream, std::string &path, long long &size)
+    {
+        auto it = files.find(stream);
+        if (it == files.end())
+            return false;
+        it->second.file.close();
+        path = it->second.path;
+        size = it->second.received;
+        bool complete = it->second.received == it->second.expected;
+        if (!complete)
+        {
+            std::remove(path.c_str()); // 删除不完整文件
+            if (budget >= 0)
+                budget += it->second.expected - it->second.received;
+        }
+        files.erase(it);
+        return complete;
+    }
+
+    // 中止文件流并删除不完整文件（已写入的字节仍计入额度）
+    void abort(uint32_t stream)
+    {
+        auto it = files.find(stream);
+        if (it == files.end())
+            return;
+        if (budget >= 0)
+            budget += it->second.expected - it->second.received;
+        it->second.file.close();
+        std::remove(it->second.path.c_str());
+        files.erase(it);
+    }
+
+    void abort_all()
+    {
+        while (!files.empty())
+            abort(files.begin()->first);
+    }
+};
+
+// 服务端类
+class TCPServer
+{
+private:
+    std::string ip;
+    int port;
+    SOCKET server_socket;
+    SOCKET local_socket; // 本机（AF_UNIX）监听套接字，供同机的机器人和桥接程序绕过TCP协议栈
+    std::string local_path;
+    bool is_running;
+    int buffer_size;
+    int max_connections;
+    std::atomic<int> active_connections;
+    std::atomic<unsigned long long> accepted_total;
+    std::atomic<unsigned long long> rejected_total;
+    std::atomic<int> accept_loops_running;
+    std::atomic<bool> handing_off; // 正在向新进程交接
+    std::atomic<bool> handed_off;  // 已交接完成，本进程可以退出
+    std::string upload_dir; // 客户端上传文件的保存目录
+    long long upload_limit; // 单个连接累计可上传的字节数
+
+    // 单个连接的收发状态
+    struct Connection
+    {
+        std::string ip;
+        std::shared_ptr<FrameSender> sender;
+        FrameReader reader;
+        StreamFileSink uploads;
+        std::mutex dispatch_mutex; // 保护 reader/uploads 及下面两个标志，处理帧时持有
+        bool frozen = false;       // 交接中：收到的字节只缓存，不再分发
+        bool handed = false;       // 未处理的字节已交给新进程，之后收到的数据无法转交
+    };
+    std::map<SOCKET, std::shared_ptr<Connection>> sessions; // 本进程持有的连接
+    std::vector<std::tuple<SOCKET, std::string, std::string>> pending_imports; // 接管得到、等待 start() 后开始处理的连接（套接字、IP、未处理的字节）
+    std::mutex sessions_mutex;
+    std::deque<std::pair<SOCKET, std::string>> launch_queue; // 已接入、等待创建处理线程的连接
+    std::mutex launch_mutex;
+    std::condition_variable launch_cv;
+    std::mutex console_mutex; // 控制台输出互斥锁
+
+    // 设置套接字阻塞模式
+    static bool set_non_blocking(SOCKET sock, bool enabled)
+    {
+        u_long mode = enabled ? 1 : 0;
+        return ioctlsocket(sock, FIONBIO, &mode) != SOCKET_ERROR;
+    }
+
+    // 监听线程：批量取出积压队列中的连接，再统一完成接入
+    void accept_loop(SOCKET listen_sock)
+    {
+        std::vector<std::pair<SOCKET, sockaddr_storage>> batch;
+        batch.reserve(ACCEPT_BATCH_SIZE);
+        auto window_start = std::chrono::steady_clock::now();
+        unsigned long long window_accepted = 0;
+
+        while (is_running && !handing_off)
+        {
+            // 等待监听套接字可读，超时用于检查运行状态和输出统计
+            fd_set read_set;
+            FD_ZERO(&read_set);
+            FD_SET(listen_sock, &read_set);
+            timeval timeout = {0, 200000};
+            int ready = select(0, &read_set, nullptr, nullptr, &timeout);
+            if (ready == SOCKET_ERROR)
+            {
+                if (is_running)
+                    log_error("等待客户端连接失败");
+                break;
+            }
+
+            // 非阻塞地一次性取完积压队列（每轮最多 ACCEPT_BATCH_SIZE 个）
+            batch.clear();
+            while (ready > 0 && (int)batch.size() < ACCEPT_BATCH_SIZE)
+            {
+                sockaddr_storage client_addr;
+                int client_addr_len = sizeof(client_addr);
+                SOCKET client_sock = accept(listen_sock, (SOCKADDR *)&client_addr, &client_addr_len);
+                if (client_sock == INVALID_SOCKET)
+                {
+                    int err = WSAGetLastError();
+                    if (err != WSAEWOULDBLOCK && err != WSAECONNRESET && is_running)
+                        log_error("接受客户端连接失败");
+                    break;
+                }
+                batch.push_back(std::make_pair(client_sock, client_addr));
+            }
+
+            // 积压队列取空后再做每个连接的初始化
+            for (auto &entry : batch)
+            {
+                if (admit_client(entry.first, entry.second))
+                    ++window_accepted;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            double elapsed = std::chrono::duration<double>(now - window_start).count();
+            if (elapsed >= ACCEPT_STATS_INTERVAL)
+            {
+                if (window_accepted > 0)
+                {
+                    AcceptStats stats = get_accept_stats();
+                    log_debug("接入速率: " + std::to_string((long long)(window_accepted / elapsed)) + " 连接/秒，活跃连接: " +
+                              std::to_string(stats.active) + "，累计拒绝: " + std::to_string(stats.rejected));
+                }
+                window_start = now;
+                window_accepted = 0;
+            }
+        }
+
+        --accept_loops_running;
+    }
+
+    // 启动一个监听线程（计数在启动前增加，保证交接时能看到所有监听线程）
+    void start_accept_loop(SOCKET listen_sock)
+    {
+        ++accept_loops_running;
+        std::thread(&TCPServer::accept_loop, this, listen_sock).detach();
+    }
+
+    // 接入单个连接：超过上限时回复繁忙帧并关闭，否则交给处理线程
+    bool admit_client(SOCKET client_sock, const sockaddr_storage &client_addr)
+    {
+        if (active_connections.load() >= max_connections)
+        {
+            // 套接字仍处于非阻塞模式，发送失败也不会卡住监听线程
+            std::string busy = encode_frame(FRAME_MESSAGE, 0, SERVER_BUSY_FRAME, sizeof(SERVER_BUSY_FRAME) - 1);
+            send(client_sock, busy.data(), (int)busy.size(), 0);
+            shutdown(client_sock, SD_SEND);
+            closesocket(client_sock);
+            ++rejected_total;
+            return false;
+        }
+
+        // 接受的套接字继承了监听套接字的非阻塞模式，处理线程需要阻塞读
+        if (!set_non_blocking(client_sock, false))
+        {
+            log_error("设置客户端套接字为阻塞模式失败");
+            closesocket(client_sock);
+            return false;
+        }
+
+        ++accepted_total;
+        register_session(client_sock, "");
+        // 处理线程由启动线程创建，监听线程只负责取连接
+        {
+            std::lock_guard<std::mutex> lock(launch_mutex);
+            launch_queue.push_back(std::make_pair(client_sock, format_address(client_addr)));
+        }
+        launch_cv.notify_one();
+        return true;
+    }
+
+    // 启动线程：为排队的连接创建处理线程
+    // 每个连接仍由一个阻塞读的线程处理（帧分发锁和热重启交接都依赖这一点），这里只把创建线程的开销移出监听线程
+    void launch_loop()
+    {
+        std::unique_lock<std::mutex> lock(launch_mutex);
+        while (is_running)
+        {
+            launch_cv.wait_for(lock, std::chrono::milliseconds(200), [this]
+                               { return !launch_queue.empty(); });
+            while (!launch_queue.empty())
+            {
+                std::pair<SOCKET, std::string> entry = launch_queue.front();
+                launch_queue.pop_front();
+                lock.unlock();
+                // 排队期间已交接的连接，处理线程发现后直接退出
+                std::thread(&TCPServer::handle_client, this, entry.first, entry.second).detach();
+                lock.lock();
+            }
+        }
+    }
+
+    // 客户端地址转为字符串（本机连接统一显示为 local）
+    static std::string format_address(const sockaddr_storage &addr)
+    {
+        if (addr.ss_family == AF_INET)
+            return inet_ntoa(((const sockaddr_in *)&addr)->sin_addr);
+        return LOCAL_CLIENT_IP;
+    }
+
+    // 登记本进程持有的连接（在处理线程启动前完成，保证交接快照不遗漏）
+    void register_session(SOCKET client_sock, const std::string &client_ip, const std::string &unread = "")
+    {
+        // 限制单次 send 的阻塞时间，对端不读时发送线程和调用者不会被永久卡住
+        DWORD send_timeout = SEND_TIMEOUT;
+        setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO, (const char *)&send_timeout, sizeof(send_timeout));
+
+        auto conn = std::make_shared<Connection>();
+        conn->ip = client_ip;
+        conn->sender = std::make_shared<FrameSender>(client_sock);
+        conn->reader.append(unread.data(), unread.size());
+        conn->uploads.set_dir(upload_dir);
+        conn->uploads.set_limit(upload_limit);
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        sessions[client_sock] = conn;
+        ++active_connections;
+    }
+
+    // 注销连接，返回该连接是否仍归本进程所有（已交接的连接由新进程负责关闭）
+    bool release_session(SOCKET client_sock)
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        return sessions.erase(client_sock) > 0;
+    }
+
+    std::shared_ptr<FrameSender> sender_of(SOCKET client_sock)
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        auto it = sessions.find(client_sock);
+        return it == sessions.end() ? nullptr : it->second->sender;
+    }
+
+    // 处理已收到的完整帧：消息交给 on_receive，文件流写入上传目录；需要断开时返回false
+    // 调用者须持有 conn.dispatch_mutex
+    bool process_frames(SOCKET client_sock, const std::string &client_ip, Connection &conn)
+    {
+        StreamFileSink &uploads = conn.uploads;
+        Frame frame;
+        bool error = false;
+        while (conn.reader.next(frame, error))
+        {
+            switch (frame.type)
+            {
+            case FRAME_MESSAGE:
+                // 非法UTF-8的消息直接丢弃，不交给上层处理
+                if (!utf8_valid(frame.payload))
+                {
+                    log_error("丢弃非UTF-8编码的消息 (" + client_ip + ")");
+                    break;
+                }
+                // 调用用户自定义处理函数，返回false时断开连接
+                if (!on_receive(client_sock, client_ip, frame.payload))
+                    return false;
+                break;
+            case FRAME_STREAM_OPEN:
+                if (!accept_upload(client_sock, client_ip))
+                    log_error("拒绝未登录连接的文件上传 (" + client_ip + ")");
+                else if (!uploads.open(frame.stream, frame.payload))
+                    log_error("拒绝上传文件：超出大小或数量限制，或无法创建 (" + client_ip + ")");
+                break;
+            case FRAME_STREAM_DATA:
+                if (!uploads.write(frame.stream, frame.payload))
+                    log_error("上传数据超出声明的文件大小，已中止 (" + client_ip + ")");
+                break;
+            case FRAME_STREAM_END:
+            {
+                std::string path;
+                long long size = 0;
+                if (uploads.finish(frame.stream, path, size))
+                    on_file_received(client_sock, client_ip, path, size);
+                else
+                    log_error("文件接收不完整 (" + client_ip + ")");
+                break;
+            }
+            case FRAME_STREAM_ABORT:
+                uploads.abort(frame.stream);
+                log_info("客户端 " + client_ip + " 中止了文件上传");
+                break;
+            }
+        }
+
+        if (error)
+        {
+            log_error("收到无效数据帧 (" + client_ip + ")");
+            return false;
+        }
+        return true;
+    }
+
+    // 处理单个客户端的线程函数
+    void handle_client(SOCKET client_sock, std::string client_ip)
+    {
+        std::shared_ptr<Connection> conn;
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex);
+            auto it = sessions.find(client_sock);
+            if (it != sessions.end())
+            {
+                conn = it->second;
+                conn->ip = client_ip;
+            }
+        }
+        if (!conn)
+        {
+            --active_connections; // 线程启动前连接已被交接
+            return;
+        }
+
+        char *recv_buf = new (std::nothrow) char[buffer_size];
+        if (!recv_buf)
+        {
+            log_error("内存分配失败");
+            if (release_session(client_sock))
+            {
+                conn->sender->close();
+                closesocket(client_sock);
+            }
+            --active_connections;
+            return;
+        }
+
+        log_info("客户端 " + client_ip + " 连接成功");
+
+        // 接管得到的连接可能带有旧进程未处理完的字节
+        bool open;
+        {
+            std::lock_guard<std::mutex> lock(conn->dispatch_mutex);
+            open = conn->frozen || process_frames(client_sock, client_ip, *conn);
+        }
+        bool peer_gone = false;
+        while (open && is_running)
+        {
+            int ret = recv(client_sock, recv_buf, buffer_size, 0);
+            if (ret <= 0)
+            {
+                if (handing_off)
+                    break; // 交接期间描述符被关闭，连接本身已转给新进程
+                peer_gone = true;
+                if (ret < 0)
+                    log_error("接收数据失败 (" + client_ip + ")");
+                else
+                    log_info("客户端 " + client_ip + " 断开连接");
+                break;
+            }
+
+            std::lock_guard<std::mutex> lock(conn->dispatch_mutex);
+            if (conn->handed)
+            {
+                log_error("交接完成后收到的数据无法转交 (" + client_ip + ")");
+                break;
+            }
+            conn->reader.append(recv_buf, ret);
+            // 交接期间只缓存，交接成功后随未处理字节一起交给新进程
+            if (!conn->frozen)
+                open = process_frames(client_sock, client_ip, *conn);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(conn->dispatch_mutex);
+            conn->uploads.abort_all();
+        }
+        delete[] recv_buf;
+        if (release_session(client_sock))
+        {
+            on_disconnect(client_sock, client_ip);
+            // 对端已断开时不再发送排队的数据；正在进行的 send 最多阻塞 SEND_TIMEOUT，处理线程不会被卡住
+            conn->sender->close(!peer_gone);
+            closesocket(client_sock);
+            log_info("客户端 " + client_ip + " 连接已关闭");
+        }
+        --active_connections;
+    }
+
+    std::string handoff_pipe_name() const
+    {
+        return HANDOFF_PIPE_PREFIX + std::to_string(port);
+    }
+
+    // 命名管道完整读写
+    static bool pipe_write(HANDLE pipe, const void *data, DWORD size)
+    {
+        const char *ptr = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            DWORD written = 0;
+            if (!WriteFile(pipe, ptr, size, &written, NULL) || written == 0)
+                return false;
+            ptr += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    static bool pipe_read(HANDLE pipe, void *data, DWORD size)
+    {
+        char *ptr = static_cast<char *>(data);
+        while (size > 0)
+        {
+            DWORD read = 0;
+            if (!ReadFile(pipe, ptr, size, &read, NULL) || read == 0)
+                return false;
+            ptr += read;
+            size -= read;
+        }
+        return true;
+    }
+
+    static bool pipe_write_string(HANDLE pipe, const std::string &str)
+    {
+        uint32_t len = (uint32_t)str.size();
+        return pipe_write(pipe, &len, sizeof(len)) && (len == 0 || pipe_write(pipe, str.data(), len));
+    }
+
+    static bool pipe_read_string(HANDLE pipe, std::string &str)
+    {
+        uint32_t len = 0;
+        if (!pipe_read(pipe, &len, sizeof(len)))
+            return false;
+        str.assign(len, '\0');
+        return len == 0 || pipe_read(pipe, &str[0], len);
+    }
+
+    // 写入一条交接记录
+    static bool write_handoff_record(HANDLE pipe, uint32_t kind, const WSAPROTOCOL_INFO &info,
+                                     const std::string &client_ip, const std::string &state)
+    {
+        return pipe_write(pipe, &kind, sizeof(kind)) && pipe_write(pipe, &info, sizeof(info)) &&
+               pipe_write_string(pipe, client_ip) && pipe_write_string(pipe, state);
+    }
 
-    // 处理单个客户端的线程函数
-    void handle_client(SOCKET client_sock, const std::string &client_ip)
+    // 把监听套接字和全部连接交给通过管道连入的新进程
+    bool hand_off(HANDLE pipe)
     {
-        char *recv_buf = new char[buffer_size + 1];
-        if (!recv_buf)
+        DWORD successor_pid = 0;
+        if (!pipe_read(pipe, &successor_pid, sizeof(successor_pid)))
+            return false;
+
+        log_info("新进程 (PID " + std::to_string(successor_pid) + ") 请求接管，开始交接");
+        handing_off = true;
+        while (accept_loops_running > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        std::vector<std::pair<SOCKET, std::shared_ptr<Connection>>> snapshot;
         {
-            log_error("内存分配失败");
-            closesocket(client_sock);
-            return;
+            std::lock_guard<std::mutex> lock(sessions_mutex);
+            snapshot.assign(sessions.begin(), sessions.end());
         }
 
-        log_info("客户端 " + client_ip + " 连接成功");
+        // 先停止分发再导出会话状态，保证导出后不会再有消息改变状态
+        for (auto &entry : snapshot)
+        {
+            std::lock_guard<std::mutex> lock(entry.second->dispatch_mutex);
+            entry.second->frozen = true;
+        }
 
-        while (is_running)
+        WSAPROTOCOL_INFO info;
+        bool ok = WSADuplicateSocket(server_socket, successor_pid, &info) != SOCKET_ERROR &&
+                  write_handoff_record(pipe, HANDOFF_LISTENER, info, ip, "");
+        if (ok && local_socket != INVALID_SOCKET)
+            ok = WSADuplicateSocket(local_socket, successor_pid, &info) != SOCKET_ERROR &&
+                 write_handoff_record(pipe, HANDOFF_LOCAL_LISTENER, info, local_path, "");
+
+        // 复制失败的连接（如恰好断开）直接跳过，仍由本进程关闭
+        std::vector<std::pair<SOCKET, std::shared_ptr<Connection>>> handed;
+        for (size_t i = 0; ok && i < snapshot.size(); ++i)
         {
-            int ret = recv(client_sock, recv_buf, buffer_size, 0);
-            if (ret <= 0)
+            SOCKET sock = snapshot[i].first;
+            if (WSADuplicateSocket(sock, successor_pid, &info) == SOCKET_ERROR)
             {
-                if (ret < 0)
-                    log_error("接收数据失败 (" + client_ip + ")");
-                else
-                    log_info("客户端 " + client_ip + " 断开连接");
-                break;
+                log_error("复制套接字失败 (" + snapshot[i].second->ip + ")");
+                continue;
             }
+            ok = write_handoff_record(pipe, HANDOFF_SESSION, info, snapshot[i].second->ip, export_session(sock));
+            handed.push_back(snapshot[i]);
+        }
+        ok = ok && pipe_write(pipe, &HANDOFF_END, sizeof(HANDOFF_END));
 
-            recv_buf[ret] = '\0';
-            std::string data(recv_buf, ret);
+        // 新进程必须先取得全部套接字，旧进程才能关闭自己的描述符
+        char ack = 0;
+        ok = ok && pipe_read(pipe, &ack, sizeof(ack));
+        if (!ok)
+        {
+            log_error("交接失败，继续由本进程提供服务");
+            // 恢复分发，并处理冻结期间缓存的帧；需要断开的连接由其处理线程收尾
+            for (auto &entry : snapshot)
+            {
+                std::lock_guard<std::mutex> lock(entry.second->dispatch_mutex);
+                entry.second->frozen = false;
+                if (sender_of(entry.first) && !process_frames(entry.first, entry.second->ip, *entry.second))
+                    shutdown(entry.first, SD_BOTH);
+            }
+            handing_off = false;
+            start_accept_loop(server_socket);
+            if (local_socket != INVALID_SOCKET)
+                start_accept_loop(local_socket);
+            return false;
+        }
 
-            // 调用用户自定义处理函数
-            if (!on_receive(client_sock, client_ip, data))
+        // 新进程无法续传进行中的上传：中止并通知客户端重新发送，再让子类通知其他带不过去的状态
+        for (auto &entry : handed)
+        {
+            std::vector<std::string> names;
             {
-                break; // 用户处理函数返回false时断开连接
+                std::lock_guard<std::mutex> lock(entry.second->dispatch_mutex);
+                names = entry.second->uploads.open_names();
+                entry.second->uploads.abort_all();
             }
+            for (const std::string &name : names)
+                send_data(entry.first, "系统消息: 服务器正在重启，文件 " + name + " 未传完，请重新发送");
+            on_handing_off(entry.first);
         }
 
-        delete[] recv_buf;
-        closesocket(client_sock);
-        log_info("客户端 " + client_ip + " 连接已关闭");
+        // 先停止发送（发完当前帧、中止未完成的文件流），保证新进程接手时帧边界完整
+        // 各连接同时停止，对端不读时 send 在 SEND_TIMEOUT 后失败；没能发完的连接帧边界已破坏，不再交给新进程
+        for (auto &entry : handed)
+            entry.second->sender->begin_close();
+        std::vector<char> intact(handed.size());
+        for (size_t i = 0; i < handed.size(); ++i)
+        {
+            intact[i] = handed[i].second->sender->close() ? 1 : 0;
+            if (!intact[i])
+                log_error("连接 " + handed[i].second->ip + " 未能在交接前发完数据，将被断开");
+        }
+
+        // 关闭本进程的描述符以唤醒阻塞在recv上的处理线程；底层连接仍由新进程持有
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex);
+            for (auto &entry : handed)
+            {
+                if (sessions.erase(entry.first) > 0)
+                    closesocket(entry.first);
+            }
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDOFF_DRAIN_TIMEOUT);
+        while (active_connections > static_cast<int>(snapshot.size() - handed.size()) &&
+               std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if (active_connections > static_cast<int>(snapshot.size() - handed.size()))
+            log_error("部分处理线程未及时退出，其之后收到的数据将被丢弃");
+
+        // 把各连接是否完好以及尚未处理的字节交给新进程（在锁内读取并封存，处理线程不会再追加），然后通知其开始读取
+        for (size_t i = 0; i < handed.size(); ++i)
+        {
+            std::string pending;
+            {
+                std::lock_guard<std::mutex> lock(handed[i].second->dispatch_mutex);
+                handed[i].second->handed = true;
+                pending = handed[i].second->reader.pending();
+            }
+            pipe_write(pipe, &intact[i], sizeof(intact[i]));
+            pipe_write_string(pipe, pending);
+        }
+        // 先让子类把内存中的状态落盘，新进程收到完成标志后才会读取
+        on_handed_off();
+        char done = 1;
+        pipe_write(pipe, &done, sizeof(done));
+        log_info("已交接 " + std::to_string(handed.size()) + " 个连接");
+        handed_off = true;
+        return true;
+    }
+
+    // 交接管道监听线程
+    void handoff_loop()
+    {
+        std::string pipe_name = handoff_pipe_name();
+        while (is_running && !handed_off)
+        {
+            HANDLE pipe = CreateNamedPipeA(pipe_name.c_str(), PIPE_ACCESS_DUPLEX,
+                                           PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                           1, 4096, 4096, 0, NULL);
+            if (pipe == INVALID_HANDLE_VALUE)
+            {
+                // 刚完成接管时旧进程可能还未释放同名管道
+                if (GetLastError() == ERROR_PIPE_BUSY)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+                    continue;
+                }
+                log_error("创建交接管道失败");
+                return;
+            }
+
+            if (ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED)
+            {
+                if (is_running)
+                    hand_off(pipe);
+                FlushFileBuffers(pipe);
+                DisconnectNamedPipe(pipe);
+            }
+            CloseHandle(pipe);
+        }
     }
 
 protected:
@@ -118,7 +1685,10 @@ protected:
 public:
     // 构造函数
     TCPServer(std::string ip = "0.0.0.0", int port = 8080, int buffer_size = DEFAULT_BUFFER_SIZE)
-        : ip(ip), port(port), server_socket(INVALID_SOCKET), is_running(false), buffer_size(buffer_size) {}
+        : ip(ip), port(port), server_socket(INVALID_SOCKET), local_socket(INVALID_SOCKET), is_running(false), buffer_size(buffer_size),
+          max_connections(DEFAULT_MAX_CONNECTIONS), active_connections(0), accepted_total(0), rejected_total(0),
+          accept_loops_running(0), handing_off(false), handed_off(false), upload_dir(DEFAULT_UPLOAD_DIR),
+          upload_limit(DEFAULT_UPLOAD_LIMIT) {}
 
     // 析构函数
     ~TCPServer()
@@ -172,6 +1742,159 @@ public:
         return true;
     }
 
+    // 从同端口上正在运行的旧进程接管监听套接字和已建立的连接（替代 init）
+    bool takeover()
+    {
+        WORD winsock_version = MAKEWORD(2, 2);
+        WSADATA wsa_data;
+        if (WSAStartup(winsock_version, &wsa_data) != 0)
+        {
+            log_error("Winsock初始化失败");
+            return false;
+        }
+
+        std::string pipe_name = handoff_pipe_name();
+        if (!WaitNamedPipeA(pipe_name.c_str(), HANDOFF_CONNECT_TIMEOUT))
+        {
+            log_error("未找到可接管的旧服务器进程");
+            WSACleanup();
+            return false;
+        }
+        HANDLE pipe = CreateFileA(pipe_name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            log_error("连接交接管道失败");
+            WSACleanup();
+            return false;
+        }
+
+        DWORD pid = GetCurrentProcessId();
+        bool ok = pipe_write(pipe, &pid, sizeof(pid));
+        std::vector<std::tuple<SOCKET, std::string, std::string>> imported;
+        size_t session_records = 0;
+        while (ok)
+        {
+            uint32_t kind = HANDOFF_END;
+            WSAPROTOCOL_INFO info;
+            std::string client_ip, state;
+            ok = pipe_read(pipe, &kind, sizeof(kind));
+            if (!ok || kind == HANDOFF_END)
+                break;
+            ok = pipe_read(pipe, &info, sizeof(info)) && pipe_read_string(pipe, client_ip) && pipe_read_string(pipe, state);
+            if (!ok)
+                break;
+
+            if (kind == HANDOFF_SESSION)
+                ++session_records;
+
+            SOCKET sock = WSASocket(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, WSA_FLAG_OVERLAPPED);
+            if (sock == INVALID_SOCKET)
+            {
+                log_error("接管套接字失败 (" + client_ip + ")");
+                if (kind == HANDOFF_SESSION)
+                    imported.push_back(std::make_tuple(INVALID_SOCKET, client_ip, state));
+                continue;
+            }
+            if (kind == HANDOFF_LISTENER)
+                server_socket = sock;
+            else if (kind == HANDOFF_LOCAL_LISTENER)
+            {
+                local_socket = sock;
+                local_path = client_ip;
+            }
+            else
+                imported.push_back(std::make_tuple(sock, client_ip, state));
+        }
+
+        // 确认已取得全部套接字，并等待旧进程停止读取、交回各连接未处理的字节
+        char ack = 1, done = 0;
+        ok = ok && server_socket != INVALID_SOCKET && pipe_write(pipe, &ack, sizeof(ack));
+        std::vector<std::string> unread(session_records);
+        std::vector<char> intact(session_records, 0);
+        for (size_t i = 0; ok && i < session_records; ++i)
+            ok = pipe_read(pipe, &intact[i], sizeof(intact[i])) && pipe_read_string(pipe, unread[i]);
+        ok = ok && pipe_read(pipe, &done, sizeof(done));
+        CloseHandle(pipe);
+        if (!ok)
+        {
+            log_error("接管失败");
+            for (auto &entry : imported)
+            {
+                if (std::get<0>(entry) != INVALID_SOCKET)
+                    closesocket(std::get<0>(entry));
+            }
+            if (server_socket != INVALID_SOCKET)
+            {
+                closesocket(server_socket);
+                server_socket = INVALID_SOCKET;
+            }
+            if (local_socket != INVALID_SOCKET)
+            {
+                closesocket(local_socket);
+                local_socket = INVALID_SOCKET;
+            }
+            WSACleanup();
+            return false;
+        }
+
+        for (size_t i = 0; i < imported.size(); ++i)
+        {
+            SOCKET sock = std::get<0>(imported[i]);
+            if (sock == INVALID_SOCKET)
+                continue;
+            // 旧进程没能发完数据的连接帧边界已破坏，直接断开，由客户端重连
+            if (!intact[i])
+            {
+                closesocket(sock);
+                continue;
+            }
+            import_session(sock, std::get<1>(imported[i]), std::get<2>(imported[i]));
+            pending_imports.push_back(std::make_tuple(sock, std::get<1>(imported[i]), unread[i]));
+        }
+        log_info("已从旧进程接管监听地址 " + ip + ":" + std::to_string(port) + " 和 " + std::to_string(pending_imports.size()) + " 个连接");
+        return true;
+    }
+
+    // 额外监听本机AF_UNIX路径（在 start 之前调用），同机程序可绕过TCP协议栈连接
+    bool listen_local(const std::string &path)
+    {
+        // 接管时已从旧进程取得同一路径的监听套接字
+        if (local_socket != INVALID_SOCKET && local_path == path)
+            return true;
+
+        sockaddr_un local_addr;
+        if (path.size() >= sizeof(local_addr.sun_path))
+        {
+            log_error("本机套接字路径过长: " + path);
+            return false;
+        }
+
+        local_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (local_socket == INVALID_SOCKET)
+        {
+            log_error("创建本机套接字失败");
+            return false;
+        }
+
+        // 清理上次运行遗留的套接字文件
+        DeleteFileA(path.c_str());
+
+        memset(&local_addr, 0, sizeof(local_addr));
+        local_addr.sun_family = AF_UNIX;
+        strcpy(local_addr.sun_path, path.c_str());
+        if (bind(local_socket, (LPSOCKADDR)&local_addr, sizeof(local_addr)) == SOCKET_ERROR)
+        {
+            log_error("绑定本机套接字 " + path + " 失败");
+            closesocket(local_socket);
+            local_socket = INVALID_SOCKET;
+            return false;
+        }
+
+        local_path = path;
+        log_info("本机套接字绑定成功: " + path);
+        return true;
+    }
+
     // 开始监听（非阻塞，支持多客户端）
     bool start()
     {
@@ -187,31 +1910,78 @@ public:
             return false;
         }
 
+        // 监听套接字设为非阻塞，便于每次唤醒后批量取出积压的连接
+        if (!set_non_blocking(server_socket, true))
+        {
+            log_error("设置监听套接字为非阻塞模式失败");
+            return false;
+        }
+
+        if (local_socket != INVALID_SOCKET &&
+            (listen(local_socket, SOMAXCONN) == SOCKET_ERROR || !set_non_blocking(local_socket, true)))
+        {
+            log_error("本机套接字监听失败");
+            closesocket(local_socket);
+            local_socket = INVALID_SOCKET;
+        }
+
+        CreateDirectoryA(upload_dir.c_str(), NULL);
+
         is_running = true;
         log_info("服务器开始监听，等待客户端连接...");
 
-        // 启动监听线程
-        std::thread([this]()
-                    {
-            while (is_running) {
-                sockaddr_in client_addr;
-                int client_addr_len = sizeof(client_addr);
-                SOCKET client_sock = accept(server_socket, (SOCKADDR*)&client_addr, &client_addr_len);
+        // 启动监听线程（TCP和本机套接字共用同一套接入与处理逻辑）
+        std::thread(&TCPServer::launch_loop, this).detach();
+        start_accept_loop(server_socket);
+        if (local_socket != INVALID_SOCKET)
+            start_accept_loop(local_socket);
 
-                if (client_sock == INVALID_SOCKET) {
-                    if (is_running) log_error("接受客户端连接失败");
-                    continue;
-                }
+        // 继续处理从旧进程接管的连接
+        for (auto &entry : pending_imports)
+            adopt_client(std::get<0>(entry), std::get<1>(entry), std::get<2>(entry));
+        pending_imports.clear();
+        on_started();
 
-                // 启动新线程处理客户端
-                std::string client_ip = inet_ntoa(client_addr.sin_addr);
-                std::thread(&TCPServer::handle_client, this, client_sock, client_ip).detach();
-            } })
-            .detach();
+        // 等待后继进程接管
+        std::thread(&TCPServer::handoff_loop, this).detach();
 
         return true;
     }
 
+    // 是否已把全部连接交给新进程
+    bool is_handed_off() const
+    {
+        return handed_off;
+    }
+
+    // 设置客户端上传文件的保存目录
+    void set_upload_dir(const std::string &dir)
+    {
+        upload_dir = dir;
+    }
+
+    // 设置单个连接累计可上传的字节数（对之后接入的连接生效）
+    void set_upload_limit(long long bytes)
+    {
+        upload_limit = bytes;
+    }
+
+    // 设置同时在线连接上限
+    void set_max_connections(int limit)
+    {
+        max_connections = limit;
+    }
+
+    // 获取连接接入统计
+    AcceptStats get_accept_stats() const
+    {
+        AcceptStats stats;
+        stats.accepted = accepted_total.load();
+        stats.rejected = rejected_total.load();
+        stats.active = active_connections.load();
+        return stats;
+    }
+
     // 停止服务器
     void stop()
     {
@@ -227,11 +1997,20 @@ public:
             server_socket = INVALID_SOCKET;
         }
 
+        if (local_socket != INVALID_SOCKET)
+        {
+            closesocket(local_socket);
+            local_socket = INVALID_SOCKET;
+            // 已交接时套接字文件归新进程使用
+            if (!handed_off)
+                DeleteFileA(local_path.c_str());
+        }
+
         WSACleanup();
         log_info("服务器已完全关闭");
     }
 
-    // 发送数据
+    // 发送数据（作为一条消息帧；有文件流在传输时与数据块交错发送）
     bool send_data(SOCKET client_sock, const std::string &data)
     {
         if (client_sock == INVALID_SOCKET || !is_running)
@@ -240,8 +2019,18 @@ public:
             return false;
         }
 
-        int ret = send(client_sock, data.c_str(), data.size(), 0);
-        if (ret == SOCKET_ERROR)
+        std::shared_ptr<FrameSender> sender = sender_of(client_sock);
+        bool ok;
+        if (sender)
+        {
+            ok = sender->send_message(data);
+        }
+        else
+        {
+            // 连接已注销（正在关闭或已交接），句柄可能已被关闭或复用，不能绕过发送器直接写
+            ok = false;
+        }
+        if (!ok)
         {
             log_error("发送数据失败");
             return false;
@@ -249,53 +2038,125 @@ public:
         return true;
     }
 
-    // 发送文件（支持二进制）
-    bool send_file(SOCKET client_sock, const std::string &file_path)
+    // 把多条消息合并为一次写出（如补发离线消息）
+    bool send_batch(SOCKET client_sock, const std::vector<std::string> &messages)
     {
-        std::ifstream file(file_path, std::ios::binary | std::ios::ate);
-        if (!file.is_open())
+        std::string frames;
+        for (const std::string &msg : messages)
+            frames += encode_frame(FRAME_MESSAGE, 0, msg);
+
+        std::shared_ptr<FrameSender> sender = sender_of(client_sock);
+        if (!sender || !sender->send_raw(frames))
         {
-            log_error("无法打开文件: " + file_path);
+            log_error("批量发送数据失败");
             return false;
         }
+        return true;
+    }
 
-        // 获取文件大小
-        std::streamsize file_size = file.tellg();
-        file.seekg(0, std::ios::beg);
-
-        // 先发送文件名和大小
-        std::string file_info = "FILE:" + std::string(file_path) + ":" + std::to_string(file_size) + "\n";
-        if (!send_data(client_sock, file_info))
+    // 发送文件（支持二进制）：作为文件流排队，立即返回，不阻塞同一连接上的聊天消息
+    bool send_file(SOCKET client_sock, const std::string &file_path, int priority = STREAM_DEFAULT_PRIORITY)
+    {
+        std::shared_ptr<FrameSender> sender = sender_of(client_sock);
+        if (!sender)
+        {
+            log_error("发送文件失败：连接不存在");
+            return false;
+        }
+        if (!sender->send_stream(file_path, file_basename(file_path), priority))
         {
-            file.close();
+            log_error("无法打开文件: " + file_path);
             return false;
         }
+        log_info("文件开始发送: " + file_path);
+        return true;
+    }
 
-        // 发送文件内容
-        char *buffer = new char[buffer_size];
-        while (file_size > 0)
+    // 发送共享映射中的文件（多个接收者共用同一份映射）
+    bool send_shared_file(SOCKET client_sock, std::shared_ptr<const MappedFile> mapped, const std::string &name,
+                          int priority = STREAM_DEFAULT_PRIORITY)
+    {
+        std::shared_ptr<FrameSender> sender = sender_of(client_sock);
+        if (!sender || !sender->send_stream(mapped, name, priority))
         {
-            std::streamsize bytes_read = file.read(buffer, buffer_size).gcount();
-            if (bytes_read <= 0)
-                break;
+            log_error("发送文件失败: " + name);
+            return false;
+        }
+        return true;
+    }
 
-            if (send(client_sock, buffer, bytes_read, 0) != bytes_read)
-            {
-                log_error("文件发送失败");
-                delete[] buffer;
-                file.close();
-                return false;
-            }
+    // 主动连接到其他服务器，返回已连接的套接字（失败返回INVALID_SOCKET）
+    SOCKET connect_to(const std::string &remote_ip, int remote_port)
+    {
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sock == INVALID_SOCKET)
+        {
+            log_error("创建套接字失败");
+            return INVALID_SOCKET;
+        }
 
-            file_size -= bytes_read;
+        sockaddr_in remote_addr;
+        remote_addr.sin_family = AF_INET;
+        remote_addr.sin_port = htons(remote_port);
+        remote_addr.sin_addr.S_un.S_addr = inet_addr(remote_ip.c_str());
+        if (::connect(sock, (LPSOCKADDR)&remote_addr, sizeof(remote_addr)) == SOCKET_ERROR)
+        {
+            closesocket(sock);
+            return INVALID_SOCKET;
         }
+        return sock;
+    }
+
+    // 为已建立的连接启动处理线程（如接管得到的连接）
+    void adopt_client(SOCKET client_sock, const std::string &client_ip, const std::string &unread = "")
+    {
+        register_session(client_sock, client_ip, unread);
+        std::thread(&TCPServer::handle_client, this, client_sock, client_ip).detach();
+    }
 
-        delete[] buffer;
-        file.close();
-        log_info("文件发送完成: " + file_path);
+    // 热重启时导出单个连接的会话状态（用户可重写）
+    virtual std::string export_session(SOCKET client_sock)
+    {
+        return "";
+    }
+
+    // 热重启时恢复单个连接的会话状态（用户可重写）
+    virtual void import_session(SOCKET client_sock, const std::string &client_ip, const std::string &state)
+    {
+    }
+
+    // 文件上传完成回调（用户可重写），path 为保存路径
+    virtual void on_file_received(SOCKET client_sock, const std::string &client_ip, const std::string &path, long long size)
+    {
+        log_info("收到来自 " + client_ip + " 的文件: " + path + " (" + std::to_string(size) + " bytes)");
+    }
+
+    // 热重启交接前对单个连接的回调：交接已确认、连接仍可发送（用户可重写，用于通知客户端无法带到新进程的状态）
+    virtual void on_handing_off(SOCKET client_sock)
+    {
+    }
+
+    // 热重启交接回调：连接已全部冻结，在通知新进程开始服务之前调用（用户可重写，用于持久化内存中的状态）
+    virtual void on_handed_off()
+    {
+    }
+
+    // 开始服务回调：接管得到的连接已可收发（用户可重写）
+    virtual void on_started()
+    {
+    }
+
+    // 是否接受该连接上传文件（用户可重写，如只允许已登录的客户端）
+    virtual bool accept_upload(SOCKET client_sock, const std::string &client_ip)
+    {
         return true;
     }
 
+    // 连接关闭回调（用户可重写；已交接给新进程的连接不会触发）
+    virtual void on_disconnect(SOCKET client_sock, const std::string &client_ip)
+    {
+    }
+
     // 接收数据处理回调（用户可重写）
     virtual bool on_receive(SOCKET client_sock, const std::string &client_ip, const std::string &data)
     {
@@ -312,8 +2173,105 @@ private:
     std::string server_ip;
     int server_port;
     SOCKET client_socket;
-    bool is_connected; // 成员变量
+    std::atomic<bool> is_connected; // 接收线程与输入线程都会读取
     int buffer_size;
+    std::vector<char> recv_buf;
+    std::string local_path;                 // 非空表示上次通过本机套接字连接（重连时沿用）
+    std::atomic<bool> reconnect_cancelled;  // 退出时中止正在进行的重连
+    std::shared_ptr<FrameSender> sender;    // 发送调度（聊天消息与文件数据块交错）
+    std::mutex sender_mutex;                // 重连时替换 sender，与发送线程互斥
+    FrameReader reader;                  // 接收端拆帧
+    StreamFileSink downloads;            // 收到的文件流
+    std::deque<std::string> inbox;       // 已收到、尚未被 receive_data 取走的消息
+
+    // 连接建立后初始化收发状态
+    void on_connected()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sender_mutex);
+            sender = std::make_shared<FrameSender>(client_socket);
+        }
+        is_connected = true;
+        reader = FrameReader();
+        inbox.clear();
+    }
+
+    // 处理已收到的完整帧：消息进入收件箱，文件流写入下载目录；协议错误返回false
+    bool process_frames(int &files_completed)
+    {
+        Frame frame;
+        bool error = false;
+        while (reader.next(frame, error))
+        {
+            switch (frame.type)
+            {
+            case FRAME_MESSAGE:
+                if (!utf8_valid(frame.payload))
+                {
+                    log_error("丢弃非UTF-8编码的消息");
+                    break;
+                }
+                inbox.push_back(std::move(frame.payload));
+                break;
+            case FRAME_STREAM_OPEN:
+                if (!downloads.open(frame.stream, frame.payload))
+                    log_error("无法创建文件: " + frame.payload);
+                break;
+            case FRAME_STREAM_DATA:
+                downloads.write(frame.stream, frame.payload);
+                break;
+            case FRAME_STREAM_END:
+            {
+                std::string path;
+                long long size = 0;
+                if (downloads.finish(frame.stream, path, size))
+                {
+                    log_info("文件接收完成: " + path + " (" + std::to_string(size) + " bytes)");
+                    ++files_completed;
+                }
+                else
+                {
+                    log_error("文件接收不完整: " + path);
+                }
+                break;
+            }
+            case FRAME_STREAM_ABORT:
+                downloads.abort(frame.stream);
+                log_info("服务器中止了文件传输");
+                break;
+            }
+        }
+
+        if (error)
+        {
+            log_error("收到无效数据帧");
+            return false;
+        }
+        return true;
+    }
+
+    // 从套接字读取一次数据并拆帧（阻塞）
+    bool pump(int &files_completed)
+    {
+        int ret = recv(client_socket, recv_buf.data(), (int)recv_buf.size(), 0);
+        if (ret <= 0)
+        {
+            if (ret < 0)
+                log_error("接收数据失败");
+            else
+                log_info("服务器已断开连接");
+            is_connected = false;
+            return false;
+        }
+
+        reader.append(recv_buf.data(), ret);
+        if (!process_frames(files_completed))
+        {
+            is_connected = false;
+            return false;
+        }
+        return true;
+    }
 
 public:
     // 日志输出
@@ -340,7 +2298,8 @@ public:
 
     // 构造函数
     TCPClient(std::string ip, int port, int buffer_size = DEFAULT_BUFFER_SIZE)
-        : server_ip(ip), server_port(port), client_socket(INVALID_SOCKET), is_connected(false), buffer_size(buffer_size) {}
+        : server_ip(ip), server_port(port), client_socket(INVALID_SOCKET), is_connected(false), buffer_size(buffer_size),
+          recv_buf(buffer_size), reconnect_cancelled(false) {}
 
     // 析构函数
     ~TCPClient()
@@ -383,20 +2342,80 @@ public:
             return false;
         }
 
-        is_connected = true;
+        local_path.clear();
+        on_connected();
         log_info("成功连接到服务器: " + server_ip + ":" + std::to_string(server_port));
         return true;
     }
 
-    // 断开连接
+    // 通过本机AF_UNIX套接字连接同机的服务器（绕过TCP协议栈，收发接口不变）
+    bool connect_local(const std::string &path)
+    {
+        sockaddr_un server_addr;
+        if (path.size() >= sizeof(server_addr.sun_path))
+        {
+            log_error("本机套接字路径过长: " + path);
+            return false;
+        }
+
+        // 初始化Winsock
+        WORD winsock_version = MAKEWORD(2, 2);
+        WSADATA wsa_data;
+        if (WSAStartup(winsock_version, &wsa_data) != 0)
+        {
+            log_error("Winsock初始化失败");
+            return false;
+        }
+
+        // 创建套接字
+        client_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (client_socket == INVALID_SOCKET)
+        {
+            log_error("创建客户端套接字失败");
+            WSACleanup();
+            return false;
+        }
+
+        // 连接服务器
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sun_family = AF_UNIX;
+        strcpy(server_addr.sun_path, path.c_str());
+
+        if (::connect(client_socket, (LPSOCKADDR)&server_addr, sizeof(server_addr)) == SOCKET_ERROR)
+        {
+            log_error("连接本机服务器 " + path + " 失败");
+            closesocket(client_socket);
+            WSACleanup();
+            return false;
+        }
+
+        local_path = path;
+        on_connected();
+        log_info("成功连接到本机服务器: " + path);
+        return true;
+    }
+
+    // 断开连接（连接已被对端断开时也要释放套接字）
     void disconnect()
     {
-        if (!is_connected)
+        if (client_socket == INVALID_SOCKET)
             return;
 
         is_connected = false;
         log_info("正在断开与服务器的连接...");
 
+        // 发完已排队的消息，中止未完成的文件流
+        std::shared_ptr<FrameSender> old_sender;
+        {
+            std::lock_guard<std::mutex> lock(sender_mutex);
+            old_sender.swap(sender);
+        }
+        if (old_sender)
+        {
+            old_sender->close();
+        }
+        downloads.abort_all();
+
         if (client_socket != INVALID_SOCKET)
         {
             closesocket(client_socket);
@@ -407,17 +2426,54 @@ public:
         log_info("已断开与服务器的连接");
     }
 
-    // 发送数据
+    // 断线后重新连接上次的服务器，按指数退避并加入随机抖动，避免大量客户端同时重连
+    // max_attempts 为0表示不限次数；调用 cancel_reconnect 后返回false
+    bool reconnect(int max_attempts = 0)
+    {
+        disconnect();
+
+        std::mt19937 rng(std::random_device{}() ^ (unsigned)std::chrono::steady_clock::now().time_since_epoch().count());
+        int delay = RECONNECT_MIN_MS;
+        for (int attempt = 1; max_attempts == 0 || attempt <= max_attempts; ++attempt)
+        {
+            // 在 [delay/2, delay] 内随机等待，分段睡眠以便及时响应取消
+            int wait = delay / 2 + (int)(rng() % (delay / 2 + 1));
+            for (int waited = 0; waited < wait && !reconnect_cancelled; waited += 100)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(std::min(100, wait - waited)));
+            }
+            if (reconnect_cancelled)
+                return false;
+
+            log_info("正在重连 (第 " + std::to_string(attempt) + " 次)...");
+            if (local_path.empty() ? connect() : connect_local(local_path))
+                return true;
+            delay = std::min(delay * 2, RECONNECT_MAX_MS);
+        }
+        return false;
+    }
+
+    // 中止正在进行及以后的重连（客户端退出时调用）
+    void cancel_reconnect()
+    {
+        reconnect_cancelled = true;
+    }
+
+    // 发送数据（线程安全；有文件在发送时与数据块交错发出）
     bool send_data(const std::string &data)
     {
-        if (!is_connected || client_socket == INVALID_SOCKET)
+        std::shared_ptr<FrameSender> current;
+        {
+            std::lock_guard<std::mutex> lock(sender_mutex);
+            current = sender;
+        }
+        if (!is_connected || !current)
         {
             log_error("发送失败：未连接到服务器");
             return false;
         }
 
-        int ret = send(client_socket, data.c_str(), data.size(), 0);
-        if (ret == SOCKET_ERROR)
+        if (!current->send_message(data))
         {
             log_error("发送数据失败");
             return false;
@@ -425,7 +2481,7 @@ public:
         return true;
     }
 
-    // 接收数据（阻塞）
+    // 接收数据（阻塞），期间到达的文件数据会直接写入下载目录
     bool receive_data(std::string &data)
     {
         if (!is_connected || client_socket == INVALID_SOCKET)
@@ -434,143 +2490,526 @@ public:
             return false;
         }
 
-        char *recv_buf = new char[buffer_size + 1];
-        int ret = recv(client_socket, recv_buf, buffer_size, 0);
-
-        if (ret <= 0)
+        int files_completed = 0;
+        while (inbox.empty())
         {
-            if (ret < 0)
-                log_error("接收数据失败");
-            else
-                log_info("服务器已断开连接");
-
-            delete[] recv_buf;
-            is_connected = false;
-            return false;
+            if (!pump(files_completed))
+                return false;
         }
 
-        recv_buf[ret] = '\0';
-        data = std::string(recv_buf, ret);
-        delete[] recv_buf;
+        data = std::move(inbox.front());
+        inbox.pop_front();
         return true;
     }
 
-    // 发送文件（支持二进制）
-    bool send_file(const std::string &file_path)
+    // 发送文件（支持二进制）：作为文件流排队后立即返回，聊天消息不会被阻塞
+    // remote_name 为对端看到的文件名，默认取本地文件名
+    bool send_file(const std::string &file_path, int priority = STREAM_DEFAULT_PRIORITY, const std::string &remote_name = "")
     {
-        std::ifstream file(file_path, std::ios::binary | std::ios::ate);
-        if (!file.is_open())
+        std::shared_ptr<FrameSender> current;
+        {
+            std::lock_guard<std::mutex> lock(sender_mutex);
+            current = sender;
+        }
+        if (!is_connected || !current)
+        {
+            log_error("发送文件失败：未连接到服务器");
+            return false;
+        }
+
+        if (!current->send_stream(file_path, remote_name.empty() ? file_basename(file_path) : remote_name, priority))
         {
             log_error("无法打开文件: " + file_path);
             return false;
         }
 
-        // 获取文件大小
-        std::streamsize file_size = file.tellg();
-        file.seekg(0, std::ios::beg);
+        log_info("文件开始发送: " + file_path);
+        return true;
+    }
+
+    // 设置收到的文件的保存目录（receive_data 期间到达的文件也保存在这里）
+    void set_download_dir(const std::string &save_dir)
+    {
+        downloads.set_dir(save_dir);
+    }
 
-        // 先发送文件名和大小
-        std::string file_info = "FILE:" + std::string(file_path) + ":" + std::to_string(file_size) + "\n";
-        if (!send_data(file_info))
+    // 接收文件（阻塞到下一个文件接收完成）；期间收到的聊天消息留给 receive_data
+    bool receive_file(const std::string &save_dir = ".")
+    {
+        if (!is_connected || client_socket == INVALID_SOCKET)
         {
-            file.close();
+            log_error("接收文件失败：未连接到服务器");
             return false;
         }
 
-        // 发送文件内容
-        char *buffer = new char[buffer_size];
-        while (file_size > 0)
+        downloads.set_dir(save_dir);
+        int files_completed = 0;
+        while (files_completed == 0)
         {
-            std::streamsize bytes_read = file.read(buffer, buffer_size).gcount();
-            if (bytes_read <= 0)
-                break;
+            if (!pump(files_completed))
+                return false;
+        }
+        return true;
+    }
+
+    // 检查连接状态 - 重命名以避免冲突
+    bool isConnected() const
+    {
+        return is_connected;
+    }
+};
+
+// 单线程事件驱动的客户端引擎：一个线程用 select 管理多条到服务器的连接，
+// 通过虚函数回调通知连接、消息、文件和断开事件，供机器人和桥接程序在一个进程内维持大量会话
+// 所有回调都在调用 poll/run 的线程中执行；send_message/close/stop 可以从任意线程调用
+class ClientEngine
+{
+private:
+    struct Session
+    {
+        SOCKET sock = INVALID_SOCKET;
+        bool connecting = true; // 非阻塞连接尚未完成
+        bool closing = false;   // 发完已排队的数据后关闭
+        std::string out;        // 已编码、尚未发出的帧
+        size_t out_sent = 0;
+        FrameReader reader;
+        StreamFileSink downloads;
+    };
+
+    std::map<int, std::shared_ptr<Session>> sessions;
+    std::mutex sessions_mutex; // 保护 sessions 以及各会话的 out/closing
+    int next_id;
+    SOCKET wake_socket; // 自连接的UDP套接字，用于从其他线程唤醒 select
+    std::atomic<bool> running;
+    std::vector<char> recv_buf;
+    std::string download_dir;
+    bool wsa_ready;
+
+    static bool set_non_blocking(SOCKET sock)
+    {
+        u_long mode = 1;
+        return ioctlsocket(sock, FIONBIO, &mode) != SOCKET_ERROR;
+    }
+
+    // 唤醒阻塞在 select 中的事件线程
+    void wake()
+    {
+        char byte = 0;
+        send(wake_socket, &byte, 1, 0);
+    }
+
+    // 发起非阻塞连接并登记会话，返回会话编号，失败返回-1
+    int start_session(SOCKET sock, const sockaddr *addr, int addr_len, const std::string &target)
+    {
+        if (sock == INVALID_SOCKET || !set_non_blocking(sock))
+        {
+            log_error("创建客户端套接字失败");
+            if (sock != INVALID_SOCKET)
+                closesocket(sock);
+            return -1;
+        }
+        if (::connect(sock, addr, addr_len) == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)
+        {
+            log_error("连接服务器 " + target + " 失败");
+            closesocket(sock);
+            return -1;
+        }
 
-            if (send(client_socket, buffer, bytes_read, 0) != bytes_read)
+        auto session = std::make_shared<Session>();
+        session->sock = sock;
+        session->downloads.set_dir(download_dir);
+        int id;
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex);
+            // select 一次最多等待 FD_SETSIZE 个套接字，留一个给唤醒套接字
+            if (sessions.size() + 1 >= FD_SETSIZE)
             {
-                log_error("文件发送失败");
-                delete[] buffer;
-                file.close();
-                return false;
+                log_error("会话数已达上限 " + std::to_string(FD_SETSIZE - 1));
+                closesocket(sock);
+                return -1;
             }
+            id = next_id++;
+            sessions[id] = session;
+        }
+        wake();
+        return id;
+    }
 
-            file_size -= bytes_read;
+    // 关闭会话并通知上层
+    void finish_session(int id)
+    {
+        std::shared_ptr<Session> session;
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex);
+            auto it = sessions.find(id);
+            if (it == sessions.end())
+                return;
+            session = it->second;
+            sessions.erase(it);
         }
+        session->downloads.abort_all();
+        closesocket(session->sock);
+        on_close(id);
+    }
 
-        delete[] buffer;
-        file.close();
-        log_info("文件发送完成: " + file_path);
+    // 尽量写出排队的数据；对端出错返回false
+    bool flush(Session &session)
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        while (session.out_sent < session.out.size())
+        {
+            int ret = send(session.sock, session.out.data() + session.out_sent,
+                           (int)std::min<size_t>(session.out.size() - session.out_sent, INT_MAX), 0);
+            if (ret == SOCKET_ERROR)
+            {
+                // 对端接收慢时缓冲区会一边追加一边发送，需要及时丢掉已发出的部分
+                if (session.out_sent >= ENGINE_COMPACT_BYTES && session.out_sent * 2 >= session.out.size())
+                {
+                    session.out.erase(0, session.out_sent);
+                    session.out_sent = 0;
+                }
+                return WSAGetLastError() == WSAEWOULDBLOCK;
+            }
+            session.out_sent += ret;
+        }
+        session.out.clear();
+        session.out_sent = 0;
         return true;
     }
 
-    // 接收文件
-    bool receive_file(const std::string &save_dir = ".")
+    // 解析服务器发来的一行：聊天消息去掉协议前缀后交给 on_message，控制消息在引擎内处理
+    void dispatch_message(int id, const std::string &msg)
     {
-        if (!is_connected || client_socket == INVALID_SOCKET)
+        // MSG 序号 消息：广播的聊天消息
+        if (msg.compare(0, 4, "MSG ") == 0)
         {
-            log_error("接收文件失败：未连接到服务器");
+            size_t space = msg.find(' ', 4);
+            if (space != std::string::npos)
+            {
+                on_message(id, msg.substr(space + 1), std::strtoull(msg.c_str() + 4, nullptr, 10));
+                return;
+            }
+        }
+        // 服务器连接数已满，随后会关闭连接
+        if (msg.compare(0, 12, "SERVER_BUSY ") == 0)
+        {
+            std::string reason = msg.substr(12);
+            while (!reason.empty() && (reason.back() == '\n' || reason.back() == '\r'))
+                reason.pop_back();
+            on_busy(id, reason);
+            return;
+        }
+        // 会话令牌与断线恢复：引擎不做自动重连，忽略
+        if (msg.compare(0, 8, "SESSION ") == 0 || msg.compare(0, 8, "RESUMED ") == 0 || msg == "RESUME_FAILED")
+            return;
+        // 引擎不上传共享文件，服务器请求上传时只记录
+        if (msg.compare(0, 13, "SHARE_UPLOAD ") == 0 || msg.compare(0, 9, "SHARE_OK ") == 0 ||
+            msg.compare(0, 13, "SHARE_FAILED ") == 0)
+        {
+            log_info("会话 " + std::to_string(id) + " 忽略分享回复: " + msg);
+            return;
+        }
+        // 服务器直接回复的消息（如昵称确认、搜索结果），没有序号
+        on_message(id, msg, 0);
+    }
+
+    // 读取一次数据并分发完整的帧；连接断开或协议错误返回false
+    bool read_session(int id, Session &session)
+    {
+        int ret = recv(session.sock, recv_buf.data(), (int)recv_buf.size(), 0);
+        if (ret == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+            return true;
+        if (ret <= 0)
             return false;
+
+        session.reader.append(recv_buf.data(), ret);
+        Frame frame;
+        bool error = false;
+        while (session.reader.next(frame, error))
+        {
+            switch (frame.type)
+            {
+            case FRAME_MESSAGE:
+                if (utf8_valid(frame.payload))
+                    dispatch_message(id, frame.payload);
+                else
+                    log_error("会话 " + std::to_string(id) + " 丢弃非UTF-8编码的消息");
+                break;
+            case FRAME_STREAM_OPEN:
+                if (!session.downloads.open(frame.stream, frame.payload))
+                    log_error("无法创建文件: " + frame.payload);
+                break;
+            case FRAME_STREAM_DATA:
+                session.downloads.write(frame.stream, frame.payload);
+                break;
+            case FRAME_STREAM_END:
+            {
+                std::string path;
+                long long size = 0;
+                if (session.downloads.finish(frame.stream, path, size))
+                    on_file_received(id, path, size);
+                break;
+            }
+            case FRAME_STREAM_ABORT:
+                session.downloads.abort(frame.stream);
+                break;
+            }
         }
+        if (error)
+            log_error("收到无效数据帧");
+        return !error;
+    }
+
+public:
+    // 日志输出
+    void log_info(const std::string &msg)
+    {
+        ConsoleColor::set(ConsoleColor::GREEN);
+        std::cout << "[ENGINE INFO] " << msg << std::endl;
+        ConsoleColor::set(ConsoleColor::WHITE);
+    }
+
+    void log_error(const std::string &msg)
+    {
+        ConsoleColor::set(ConsoleColor::RED);
+        std::cout << "[ENGINE ERROR] " << msg << " (错误码: " << WSAGetLastError() << ")" << std::endl;
+        ConsoleColor::set(ConsoleColor::WHITE);
+    }
+
+    explicit ClientEngine(int buffer_size = DEFAULT_BUFFER_SIZE)
+        : next_id(1), wake_socket(INVALID_SOCKET), running(false), recv_buf(buffer_size), download_dir("."),
+          wsa_ready(false) {}
 
-        // 先接收文件信息（格式：FILE:文件名:大小）
-        std::string file_info;
-        if (!receive_data(file_info))
+    virtual ~ClientEngine()
+    {
+        for (auto &entry : sessions)
         {
-            return false;
+            entry.second->downloads.abort_all();
+            closesocket(entry.second->sock);
         }
+        sessions.clear();
+        if (wake_socket != INVALID_SOCKET)
+            closesocket(wake_socket);
+        if (wsa_ready)
+            WSACleanup();
+    }
 
-        size_t pos1 = file_info.find(':');
-        size_t pos2 = file_info.find(':', pos1 + 1);
-        if (pos1 == std::string::npos || pos2 == std::string::npos || file_info.substr(0, pos1) != "FILE")
+    // 初始化Winsock和唤醒套接字
+    bool init()
+    {
+        WSADATA wsa_data;
+        if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
         {
-            log_error("无效的文件信息格式");
+            log_error("Winsock初始化失败");
             return false;
         }
-
-        std::string filename = file_info.substr(pos1 + 1, pos2 - pos1 - 1);
-        std::streamsize file_size = std::stoll(file_info.substr(pos2 + 1));
-
-        // 构建保存路径
-        std::string save_path = save_dir + "\\" + filename;
-        std::ofstream file(save_path, std::ios::binary);
-        if (!file.is_open())
+        wsa_ready = true;
+
+        wake_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.S_un.S_addr = inet_addr("127.0.0.1");
+        int addr_len = sizeof(addr);
+        if (wake_socket == INVALID_SOCKET || bind(wake_socket, (sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+            getsockname(wake_socket, (sockaddr *)&addr, &addr_len) == SOCKET_ERROR ||
+            ::connect(wake_socket, (sockaddr *)&addr, addr_len) == SOCKET_ERROR || !set_non_blocking(wake_socket))
         {
-            log_error("无法创建文件: " + save_path);
+            log_error("创建唤醒套接字失败");
             return false;
         }
+        return true;
+    }
+
+    // 设置收到的文件的保存目录（对之后打开的会话生效）
+    void set_download_dir(const std::string &dir)
+    {
+        download_dir = dir;
+    }
 
-        // 接收文件内容
-        char *buffer = new char[buffer_size];
-        std::streamsize total_received = 0;
+    // 连接到服务器，立即返回会话编号；连接结果通过 on_connect/on_close 通知
+    int open(const std::string &ip, int port)
+    {
+        sockaddr_in server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        server_addr.sin_addr.S_un.S_addr = inet_addr(ip.c_str());
+        return start_session(socket(AF_INET, SOCK_STREAM, IPPROTO_TCP), (sockaddr *)&server_addr, sizeof(server_addr),
+                             ip + ":" + std::to_string(port));
+    }
 
-        while (total_received < file_size)
+    // 通过本机AF_UNIX套接字连接同机的服务器
+    int open_local(const std::string &path)
+    {
+        sockaddr_un server_addr;
+        if (path.size() >= sizeof(server_addr.sun_path))
         {
-            std::streamsize bytes_to_read = std::min((std::streamsize)buffer_size, file_size - total_received);
-            int ret = recv(client_socket, buffer, bytes_to_read, 0);
+            log_error("本机套接字路径过长: " + path);
+            return -1;
+        }
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sun_family = AF_UNIX;
+        strcpy(server_addr.sun_path, path.c_str());
+        return start_session(socket(AF_UNIX, SOCK_STREAM, 0), (sockaddr *)&server_addr, sizeof(server_addr), path);
+    }
 
-            if (ret <= 0)
+    // 发送一条消息（只排队，由事件线程写出）；会话不存在或积压过多返回false
+    bool send_message(int id, const std::string &msg)
+    {
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex);
+            auto it = sessions.find(id);
+            if (it == sessions.end() || it->second->closing)
+                return false;
+            Session &session = *it->second;
+            if (session.out.size() - session.out_sent > ENGINE_MAX_PENDING)
             {
-                log_error("文件接收失败");
-                delete[] buffer;
-                file.close();
-                std::remove(save_path.c_str()); // 删除不完整文件
+                log_error("会话 " + std::to_string(id) + " 发送积压过多");
                 return false;
             }
+            session.out += encode_frame(FRAME_MESSAGE, 0, msg);
+        }
+        wake();
+        return true;
+    }
 
-            file.write(buffer, ret);
-            total_received += ret;
+    // 发完已排队的消息后关闭会话
+    void close(int id)
+    {
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex);
+            auto it = sessions.find(id);
+            if (it == sessions.end())
+                return;
+            it->second->closing = true;
         }
+        wake();
+    }
 
-        delete[] buffer;
-        file.close();
-        log_info("文件接收完成: " + save_path + " (" + std::to_string(total_received) + " bytes)");
-        return true;
+    // 当前会话数
+    size_t session_count()
+    {
+        std::lock_guard<std::mutex> lock(sessions_mutex);
+        return sessions.size();
     }
 
-    // 检查连接状态 - 重命名以避免冲突
-    bool isConnected() const
+    // 处理一轮网络事件，最多等待 timeout_ms 毫秒（负数表示一直等待）
+    void poll(int timeout_ms)
     {
-        return is_connected;
+        fd_set read_set, write_set, except_set;
+        FD_ZERO(&read_set);
+        FD_ZERO(&write_set);
+        FD_ZERO(&except_set);
+        FD_SET(wake_socket, &read_set);
+
+        std::vector<std::pair<int, std::shared_ptr<Session>>> active;
+        std::vector<int> finished;
+        {
+            std::lock_guard<std::mutex> lock(sessions_mutex);
+            for (auto &entry : sessions)
+            {
+                Session &session = *entry.second;
+                bool pending = session.out_sent < session.out.size();
+                if (session.closing && (session.connecting || !pending))
+                {
+                    finished.push_back(entry.first);
+                    continue;
+                }
+                active.push_back(entry);
+                if (session.connecting)
+                {
+                    // 连接成功时可写，失败时在异常集合中报告
+                    FD_SET(session.sock, &write_set);
+                    FD_SET(session.sock, &except_set);
+                    continue;
+                }
+                FD_SET(session.sock, &read_set);
+                if (pending)
+                    FD_SET(session.sock, &write_set);
+            }
+        }
+        for (int id : finished)
+        {
+            finish_session(id);
+        }
+
+        timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        int ready = select(0, &read_set, &write_set, &except_set, timeout_ms < 0 ? nullptr : &timeout);
+        if (ready == SOCKET_ERROR)
+        {
+            log_error("select 失败");
+            return;
+        }
+        if (FD_ISSET(wake_socket, &read_set))
+        {
+            char drain[64];
+            while (recv(wake_socket, drain, sizeof(drain), 0) > 0)
+            {
+            }
+        }
+
+        for (auto &entry : active)
+        {
+            int id = entry.first;
+            Session &session = *entry.second;
+            if (session.connecting)
+            {
+                if (FD_ISSET(session.sock, &except_set))
+                {
+                    log_error("会话 " + std::to_string(id) + " 连接失败");
+                    finish_session(id);
+                }
+                else if (FD_ISSET(session.sock, &write_set))
+                {
+                    session.connecting = false;
+                    on_connect(id);
+                }
+                continue;
+            }
+
+            if ((FD_ISSET(session.sock, &read_set) && !read_session(id, session)) ||
+                (FD_ISSET(session.sock, &write_set) && !flush(session)))
+            {
+                finish_session(id);
+            }
+        }
     }
+
+    // 循环处理事件直到 stop 被调用
+    void run()
+    {
+        running = true;
+        while (running)
+        {
+            poll(-1);
+        }
+    }
+
+    // 让 run 返回（可从任意线程或回调中调用）
+    void stop()
+    {
+        running = false;
+        wake();
+    }
+
+    // 回调：连接建立
+    virtual void on_connect(int id) {}
+
+    // 回调：收到一条消息（已去掉协议前缀）；seq 为广播消息的序号，服务器直接回复的消息为0
+    virtual void on_message(int id, const std::string &text, uint64_t seq) {}
+
+    // 回调：服务器连接数已满，连接随后会被关闭
+    virtual void on_busy(int id, const std::string &reason)
+    {
+        log_error("会话 " + std::to_string(id) + " 被服务器拒绝: " + reason);
+    }
+
+    // 回调：收到一个文件
+    virtual void on_file_received(int id, const std::string &path, long long size) {}
+
+    // 回调：会话结束（连接失败、被对端断开或调用了 close）
+    virtual void on_close(int id) {}
 };
 
 #endif // SOCK_HPP